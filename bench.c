@@ -0,0 +1,396 @@
+// bench.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "file_transfer.h"
+#include "network.h"
+#include "utils.h"
+#include "packets.h"
+#include "wire.h"
+#include "tune.h"
+#include "crypto.h"
+
+/*
+
+Microbenchmarks for the hot paths, run with `make bench`. Inputs are
+synthetic and seeded, sockets are in-memory (socketpair), so runs are
+comparable between builds. One line per benchmark:
+
+  name ops ns/op p50 p90 p99 max rate unit
+
+ns/op and the percentiles are per operation, in nanoseconds. rate is the
+throughput in `unit`, except for delay_microseconds where it's the mean
+overshoot past the requested delay. The aead ops are one AEAD_BATCH of
+chunks each, on the calling thread alone.
+
+*/
+
+#define BENCH_FILE_BYTES (16u << 20) // file send_file_chunk reads from
+#define BENCH_BITMAP_UNITS 10000000  // units in the CHECK scan bitmap
+
+typedef struct {
+    uint64_t *samples;
+    size_t count;
+    size_t cap;
+} Samples;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64, so the inputs don't depend on the libc
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int rng_chance(double p) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void samples_init(Samples *s, size_t cap) {
+    s->samples = malloc(cap * sizeof(uint64_t));
+    s->count = 0;
+    s->cap = cap;
+    if (!s->samples) {
+        perror_exit("Failed to allocate samples");
+    }
+}
+
+static void samples_add(Samples *s, uint64_t ns) {
+    if (s->count < s->cap) s->samples[s->count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const Samples *s, double p) {
+    size_t i = (size_t)(p * (s->count - 1) + 0.5);
+    return s->samples[i];
+}
+
+// rate_total is what the whole run moved, in `unit` (bytes for MB/s, items for M/s)
+static void report(const char *name, Samples *s, double rate_total, const char *unit) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < s->count; ++i) total += s->samples[i];
+    qsort(s->samples, s->count, sizeof(uint64_t), compare_u64);
+
+    double seconds = total / 1e9;
+    double rate = 0;
+    if (strcmp(unit, "MB/s") == 0) rate = rate_total / (1 << 20) / seconds;
+    else if (strcmp(unit, "M/s") == 0) rate = rate_total / 1e6 / seconds;
+    else rate = rate_total;
+
+    printf("%-36s %9zu %12.1f %10lu %10lu %10lu %10lu %10.1f %s\n",
+        name, s->count, (double)total / s->count,
+        percentile(s, 0.50), percentile(s, 0.90), percentile(s, 0.99), s->samples[s->count - 1],
+        rate, unit);
+    free(s->samples);
+}
+
+static void drain(int fd) {
+    uint8_t buffer[CHUNK_MAX + WIRE_CHUNK_HEADER_MAX];
+    while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+}
+
+// One path whose socket is one end of a socketpair, `peer` gets the other
+static void bench_paths(PathSet *paths, int *peer) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+        perror_exit("socketpair failed");
+    }
+    int size = 4 << 20;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    memset(paths, 0, sizeof(*paths));
+    paths->count = 1;
+    paths->paths[0].sockfd = fds[0];
+    paths->paths[0].dest_addr_len = 0; // connected, no address
+    *peer = fds[1];
+}
+
+static void bench_send_file_chunk(uint32_t chunk_size, size_t ops) {
+    FILE *fp = tmpfile();
+    if (!fp) {
+        perror_exit("Failed to create the bench file");
+    }
+    uint8_t *buffer = malloc(CHUNK_MAX);
+    for (size_t i = 0; i < CHUNK_MAX; ++i) buffer[i] = rng_next();
+    for (size_t written = 0; written < BENCH_FILE_BYTES; written += CHUNK_MAX) {
+        fwrite(buffer, 1, CHUNK_MAX, fp);
+    }
+    fflush(fp);
+
+    PathSet paths;
+    int peer;
+    bench_paths(&paths, &peer);
+    NetStats netStats;
+    memset(&netStats, 0, sizeof(netStats));
+
+    Samples s;
+    samples_init(&s, ops);
+    uint64_t chunks = BENCH_FILE_BYTES / chunk_size;
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t seq = (i % chunks) * chunk_size / CHUNK_UNIT;
+        uint64_t t = now_ns();
+        send_file_chunk(&paths, &paths.paths[0], fp, seq, chunk_size, buffer, &netStats);
+        samples_add(&s, now_ns() - t);
+        drain(peer);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "send_file_chunk/%u", chunk_size);
+    report(name, &s, (double)ops * chunk_size, "MB/s");
+
+    close(peer);
+    close(paths.paths[0].sockfd);
+    fclose(fp);
+    free(buffer);
+}
+
+// Every chunk once, then every chunk again as a duplicate
+static void bench_receive_file_chunk(uint32_t chunk_size, size_t chunks) {
+    FILE *fp = fopen("/dev/null", "wb");
+    if (!fp) {
+        perror_exit("Failed to open /dev/null");
+    }
+    uint64_t file_size = (uint64_t)chunks * chunk_size;
+    uint64_t units = file_size / CHUNK_UNIT;
+    uint64_t *received_units = calloc((units + 63) / 64, sizeof(uint64_t));
+    uint8_t *packet = malloc(chunk_size + WIRE_CHUNK_HEADER_MAX);
+    if (!received_units || !packet) {
+        perror_exit("Failed to allocate bench buffers");
+    }
+    for (size_t i = 0; i < chunk_size + WIRE_CHUNK_HEADER_MAX; ++i) packet[i] = rng_next();
+
+    // Chunks arrive in a shuffled order, like they do over several paths
+    uint64_t *order = malloc(chunks * sizeof(uint64_t));
+    for (size_t i = 0; i < chunks; ++i) order[i] = i;
+    for (size_t i = chunks - 1; i > 0; --i) {
+        size_t j = rng_next() % (i + 1);
+        uint64_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        Samples s;
+        samples_init(&s, chunks);
+        for (size_t i = 0; i < chunks; ++i) {
+            uint64_t seq = order[i] * (chunk_size / CHUNK_UNIT);
+            // Re-encode the header in place, like it arrives in the receive buffer
+            uint8_t header[WIRE_CHUNK_HEADER_MAX];
+            size_t header_len = wire_put_chunk_header(header, FILE_CHUNK, seq);
+            uint8_t *start = packet + WIRE_CHUNK_HEADER_MAX - header_len;
+            memcpy(start, header, header_len);
+
+            uint64_t t = now_ns();
+            receive_file_chunk(fp, received_units, file_size, CHUNK_UNIT, CHUNK_MAX, start, header_len + chunk_size);
+            samples_add(&s, now_ns() - t);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "receive_file_chunk/%s/%u", pass ? "dup" : "new", chunk_size);
+        report(name, &s, (double)chunks * chunk_size, "MB/s");
+    }
+
+    fclose(fp);
+    free(received_units);
+    free(packet);
+    free(order);
+}
+
+// Bitmap of BENCH_BITMAP_UNITS units with independent `loss`, scanned the way the CHECK handler does
+static uint64_t *lossy_bitmap(double loss) {
+    uint64_t *received_units = calloc((BENCH_BITMAP_UNITS + 63) / 64, sizeof(uint64_t));
+    if (!received_units) {
+        perror_exit("Failed to allocate bitmap");
+    }
+    for (uint64_t i = 0; i < BENCH_BITMAP_UNITS; ++i) {
+        if (!rng_chance(loss)) received_units[i / 64] |= 1ULL << (i % 64);
+    }
+    return received_units;
+}
+
+static void bench_collect_missing(double loss, size_t sweeps) {
+    uint64_t *received_units = lossy_bitmap(loss);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+
+    Samples s;
+    samples_init(&s, sweeps);
+    for (size_t i = 0; i < sweeps; ++i) {
+        uint64_t t = now_ns();
+        uint64_t from = 0;
+        while (from < BENCH_BITMAP_UNITS) {
+            collect_missing(received_units, from, BENCH_BITMAP_UNITS, missing, WIRE_MAX_RANGES, &from);
+        }
+        samples_add(&s, now_ns() - t);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "collect_missing/10M/loss=%g%%", 100 * loss);
+    report(name, &s, (double)sweeps * BENCH_BITMAP_UNITS, "M/s");
+
+    free(received_units);
+    free(missing);
+}
+
+// One NACK packet per op, walking the missing ranges of a lossy bitmap
+static void bench_send_nack(double loss, size_t ops) {
+    uint64_t *received_units = lossy_bitmap(loss);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+    uint64_t next;
+    size_t count = collect_missing(received_units, 0, BENCH_BITMAP_UNITS, missing, WIRE_MAX_RANGES, &next);
+
+    PathSet paths;
+    int peer;
+    bench_paths(&paths, &peer);
+
+    Samples s;
+    samples_init(&s, ops);
+    size_t done = 0;
+    uint64_t ranges = 0;
+    for (size_t i = 0; i < ops; ++i) {
+        if (done >= count) done = 0;
+        uint64_t t = now_ns();
+        size_t used = send_nack(&paths, &paths.paths[0], NACK, 0, 0, missing + done, count - done);
+        samples_add(&s, now_ns() - t);
+        done += used;
+        ranges += used;
+        drain(peer);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "send_nack/loss=%g%%", 100 * loss);
+    report(name, &s, (double)ranges, "M/s");
+
+    close(peer);
+    close(paths.paths[0].sockfd);
+    free(received_units);
+    free(missing);
+}
+
+// A sender and a receiver keyed through the real handshake
+static void bench_aead_pair(Aead **sender, Aead **receiver) {
+    uint8_t psk[32];
+    for (size_t i = 0; i < sizeof(psk); ++i) psk[i] = rng_next();
+    *sender = aead_new(psk, sizeof(psk), 1, 0);
+    *receiver = aead_new(psk, sizeof(psk), 0, 0);
+
+    InitPacket init = { .unit_size = CHUNK_UNIT, .max_chunk = CHUNK_MAX, .flags = INIT_AEAD };
+    uint8_t packet[WIRE_MAX_PACKET];
+    size_t init_len = wire_put_init(packet, &init);
+    size_t len = aead_put_init_auth(*sender, packet, init_len);
+    size_t ack_len;
+    if (aead_accept_init(*receiver, packet, len) < 0) {
+        perror_exit("Bench handshake failed");
+    }
+    const uint8_t *ack = aead_ack(*receiver, &ack_len);
+    if (aead_accept_ack(*sender, ack, ack_len) < 0) {
+        perror_exit("Bench handshake failed");
+    }
+}
+
+static void bench_aead(uint32_t chunk_size, size_t batches) {
+    Aead *sender, *receiver;
+    bench_aead_pair(&sender, &receiver);
+
+    AeadPacket packets[AEAD_BATCH];
+    uint8_t *data = malloc((size_t)AEAD_BATCH * (chunk_size + WIRE_CHUNK_HEADER_MAX + AEAD_TAG_SIZE));
+    if (!data) {
+        perror_exit("Failed to allocate bench buffers");
+    }
+
+    Samples seal_s, open_s;
+    samples_init(&seal_s, batches);
+    samples_init(&open_s, batches);
+    uint64_t seq = 0;
+    for (size_t b = 0; b < batches; ++b) {
+        for (int i = 0; i < AEAD_BATCH; ++i) {
+            AeadPacket *packet = &packets[i];
+            packet->data = data + (size_t)i * (chunk_size + WIRE_CHUNK_HEADER_MAX + AEAD_TAG_SIZE);
+            packet->header_len = wire_put_chunk_header(packet->data, FILE_CHUNK, seq);
+            for (uint32_t k = 0; k < chunk_size; k += 8) packet->data[packet->header_len + k] = rng_next();
+            packet->len = packet->header_len + chunk_size;
+            seq += chunk_size / CHUNK_UNIT;
+        }
+
+        uint64_t t = now_ns();
+        aead_seal_batch(sender, packets, AEAD_BATCH);
+        samples_add(&seal_s, now_ns() - t);
+
+        t = now_ns();
+        aead_open_batch(receiver, packets, AEAD_BATCH);
+        samples_add(&open_s, now_ns() - t);
+    }
+    if (aead_rejected(receiver) > 0) {
+        fprintf(stderr, "aead bench: %lu packets failed to open\n", aead_rejected(receiver));
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "aead_seal_batch/%u", chunk_size);
+    report(name, &seal_s, (double)batches * AEAD_BATCH * chunk_size, "MB/s");
+    snprintf(name, sizeof(name), "aead_open_batch/%u", chunk_size);
+    report(name, &open_s, (double)batches * AEAD_BATCH * chunk_size, "MB/s");
+    free(data);
+}
+
+static void bench_delay_microseconds(long delay_us, size_t ops) {
+    Samples s;
+    samples_init(&s, ops);
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t t = now_ns();
+        delay_microseconds(delay_us);
+        samples_add(&s, now_ns() - t);
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < s.count; ++i) total += s.samples[i];
+    double overshoot = (double)total / s.count - delay_us * 1000.0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "delay_microseconds/%ldus", delay_us);
+    report(name, &s, overshoot, "ns_over");
+}
+
+int main(void) {
+    printf("# supra bench, per op times in ns\n");
+    printf("# %-34s %9s %12s %10s %10s %10s %10s %10s %s\n", "name", "ops", "ns/op", "p50", "p90", "p99", "max", "rate", "unit");
+
+    bench_send_file_chunk(1408, 200000);
+    bench_send_file_chunk(8192, 50000);
+    bench_send_file_chunk(CHUNK_MAX, 10000);
+
+    bench_receive_file_chunk(1408, 200000);
+    bench_receive_file_chunk(CHUNK_MAX, 10000);
+
+    double losses[] = { 0, 0.001, 0.01, 0.1, 0.5 };
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); ++i) {
+        bench_collect_missing(losses[i], 10);
+    }
+    for (size_t i = 1; i < sizeof(losses) / sizeof(losses[0]); ++i) {
+        bench_send_nack(losses[i], 100000);
+    }
+
+    bench_aead(1408, 5000);
+    bench_aead(CHUNK_MAX, 200);
+
+    bench_delay_microseconds(1, 100000);
+    bench_delay_microseconds(10, 20000);
+    bench_delay_microseconds(100, 2000);
+    bench_delay_microseconds(1000, 500);
+    return 0;
+}
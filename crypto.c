@@ -0,0 +1,459 @@
+// crypto.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "crypto.h"
+#include "packets.h"
+#include "wire.h"
+#include "utils.h"
+
+#define PSK_MAX 1024
+
+/*
+
+AEAD mode, on when both sides pass the same --psk-file.
+
+Handshake: the sender appends a random nonce and an HMAC (keyed from the
+PSK) to its INIT. The receiver's ack is its own nonce plus an HMAC over
+both nonces. Each side then derives one AES-256-GCM key per direction
+with HKDF-SHA256(PSK, salt = sender nonce | receiver nonce). A fresh
+pair of nonces means fresh keys for every transfer.
+
+After that every datagram but INIT and PUNCH is sealed:
+
+  type  varint  ciphertext  tag
+
+The type byte and varint are authenticated but left in the clear. For
+chunks the varint is the seq number. Control packets get a per-sender
+counter put in front of their body. The 96-bit GCM nonce is
+
+  varint (64 bits LE) | payload length (16 bits LE) | type | 0
+
+so a chunk resent under another size or as a LAST_CHUNK never reuses a
+nonce. Resending the same seq, length and type seals the same bytes to
+the same ciphertext, which reveals nothing new.
+
+Replays: an INIT replayed from an earlier transfer carries a valid HMAC,
+so the receiver can't tell it from the real one by itself. Until the
+session is committed it re-keys on every valid INIT with a new nonce
+and acks it. The first sealed packet that opens commits the session,
+which only the sender holding the PSK and our nonce can produce. After
+that only INITs with the committed nonce are acked. Control counters go
+through a sliding window, so each one is accepted once. Every path has
+its own counter and window, in the low bits of the varint, so reordering
+between a fast and a slow path doesn't age the slow one's packets out.
+
+*/
+
+#define REPLAY_WINDOW 64 // control counters this far behind the highest one are still taken
+
+struct Aead {
+    int is_sender;
+    uint8_t psk[PSK_MAX];
+    size_t psk_len;
+    uint8_t auth_key[AEAD_KEY_SIZE];    // handshake HMACs
+    uint8_t local_nonce[AEAD_NONCE_SIZE];
+    uint8_t peer_nonce[AEAD_NONCE_SIZE];
+    uint8_t seal_key[AEAD_KEY_SIZE];
+    uint8_t open_key[AEAD_KEY_SIZE];
+    uint8_t ack[1 + AEAD_NONCE_SIZE + AEAD_TAG_SIZE];
+    int keyed;
+    int committed;                      // peer proved it has the session keys
+    uint64_t control_counter[AEAD_CONTROL_STREAMS];
+    uint64_t control_highest[AEAD_CONTROL_STREAMS]; // highest control counter opened, plus one
+    uint64_t control_seen[AEAD_CONTROL_STREAMS];    // bit i: control_highest - 1 - i was opened
+    uint64_t rejected;
+
+    // Worker pool: slot 0 is the calling thread
+    int workers;
+    pthread_t threads[AEAD_MAX_WORKERS];
+    EVP_CIPHER_CTX *seal_ctx[AEAD_MAX_WORKERS + 1];
+    EVP_CIPHER_CTX *open_ctx[AEAD_MAX_WORKERS + 1];
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    uint64_t generation;
+    int busy;
+    AeadPacket *batch;
+    int batch_count;
+    int shares; // how many threads split the current batch
+    int sealing;
+};
+
+typedef struct {
+    Aead *aead;
+    int slot;
+} aead_worker_t;
+
+static void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t len, uint8_t *out) {
+    unsigned int out_len = 32;
+    HMAC(EVP_sha256(), key, key_len, data, len, out, &out_len);
+}
+
+// HKDF-SHA256 with a single output block
+static void hkdf(const uint8_t *ikm, size_t ikm_len, const uint8_t *salt, size_t salt_len, const char *info, uint8_t *out) {
+    uint8_t prk[32];
+    uint8_t block[64];
+    size_t info_len = strlen(info);
+    hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+    memcpy(block, info, info_len);
+    block[info_len] = 1;
+    hmac_sha256(prk, sizeof(prk), block, info_len + 1, out);
+}
+
+static void aead_nonce(uint8_t *nonce, uint64_t value, size_t payload_len, uint8_t type) {
+    for (int i = 0; i < 8; ++i) nonce[i] = value >> (8 * i);
+    nonce[8] = payload_len;
+    nonce[9] = payload_len >> 8;
+    nonce[10] = type;
+    nonce[11] = 0;
+}
+
+static EVP_CIPHER_CTX *cipher_ctx(const uint8_t *key, int encrypt) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx || !EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, NULL, encrypt)) {
+        perror_exit("Failed to set up AES-GCM");
+    }
+    return ctx;
+}
+
+// Seals data[header_len..len) in place and appends the tag
+static int seal(EVP_CIPHER_CTX *ctx, AeadPacket *packet) {
+    uint64_t value;
+    uint8_t nonce[12];
+    size_t payload_len = packet->len - packet->header_len;
+    int out_len;
+    if (wire_get_sealed_header(packet->data, packet->header_len, &value) < 0) return -1;
+    aead_nonce(nonce, value, payload_len, wire_get_type(packet->data, packet->len));
+
+    uint8_t *payload = packet->data + packet->header_len;
+    if (!EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_EncryptUpdate(ctx, NULL, &out_len, packet->data, packet->header_len) ||
+        !EVP_EncryptUpdate(ctx, payload, &out_len, payload, payload_len) ||
+        !EVP_EncryptFinal_ex(ctx, payload + payload_len, &out_len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_SIZE, payload + payload_len)) {
+        return -1;
+    }
+    packet->len += AEAD_TAG_SIZE;
+    return 0;
+}
+
+// Opens a sealed datagram in place. Control packets lose their counter, chunks keep their seq.
+static int open_packet(EVP_CIPHER_CTX *ctx, AeadPacket *packet) {
+    int type = wire_get_type(packet->data, packet->len);
+    if (type == INIT || type == PUNCH) return 0; // the handshake has its own HMACs
+
+    uint64_t value;
+    uint8_t nonce[12];
+    int header_len = wire_get_sealed_header(packet->data, packet->len, &value);
+    if (header_len < 0 || packet->len < (size_t)header_len + AEAD_TAG_SIZE) return -1;
+    size_t payload_len = packet->len - header_len - AEAD_TAG_SIZE;
+    aead_nonce(nonce, value, payload_len, type);
+    packet->value = value;
+
+    uint8_t *payload = packet->data + header_len;
+    int out_len;
+    if (!EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_DecryptUpdate(ctx, NULL, &out_len, packet->data, header_len) ||
+        !EVP_DecryptUpdate(ctx, payload, &out_len, payload, payload_len) ||
+        !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_SIZE, payload + payload_len) ||
+        EVP_DecryptFinal_ex(ctx, payload + payload_len, &out_len) <= 0) {
+        return -1;
+    }
+
+    if (type == FILE_CHUNK || type == LAST_CHUNK) {
+        packet->len = header_len + payload_len;
+    } else {
+        memmove(packet->data + 1, payload, payload_len);
+        packet->len = 1 + payload_len;
+    }
+    return 0;
+}
+
+// Slot `slot`'s contiguous share of the current batch
+static void run_share(Aead *aead, int slot) {
+    int from = aead->batch_count * slot / aead->shares;
+    int to = aead->batch_count * (slot + 1) / aead->shares;
+    for (int i = from; i < to; ++i) {
+        AeadPacket *packet = &aead->batch[i];
+        if (aead->sealing) packet->ok = seal(aead->seal_ctx[slot], packet) == 0;
+        else packet->ok = open_packet(aead->open_ctx[slot], packet) == 0;
+    }
+}
+
+static void *aead_worker_routine(void *arg) {
+    aead_worker_t *worker = (aead_worker_t *)arg;
+    Aead *aead = worker->aead;
+    uint64_t seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&aead->lock);
+        while (aead->generation == seen) pthread_cond_wait(&aead->work, &aead->lock);
+        seen = aead->generation;
+        pthread_mutex_unlock(&aead->lock);
+
+        run_share(aead, worker->slot);
+
+        pthread_mutex_lock(&aead->lock);
+        if (--aead->busy == 0) pthread_cond_signal(&aead->done);
+        pthread_mutex_unlock(&aead->lock);
+    }
+    return NULL;
+}
+
+static void run_batch(Aead *aead, AeadPacket *packets, int count, int sealing) {
+    // Before the handshake only the handshake gets through
+    if (!aead->keyed) {
+        for (int i = 0; i < count; ++i) {
+            int type = wire_get_type(packets[i].data, packets[i].len);
+            packets[i].ok = !sealing && (type == INIT || type == PUNCH);
+        }
+        return;
+    }
+
+    aead->batch = packets;
+    aead->batch_count = count;
+    aead->sealing = sealing;
+
+    // Small batches aren't worth waking anyone for
+    if (aead->workers == 0 || count < 2 * (aead->workers + 1)) {
+        aead->shares = 1;
+        run_share(aead, 0);
+        return;
+    }
+    aead->shares = aead->workers + 1;
+
+    pthread_mutex_lock(&aead->lock);
+    aead->busy = aead->workers;
+    aead->generation++;
+    pthread_cond_broadcast(&aead->work);
+    pthread_mutex_unlock(&aead->lock);
+
+    run_share(aead, 0);
+
+    pthread_mutex_lock(&aead->lock);
+    while (aead->busy > 0) pthread_cond_wait(&aead->done, &aead->lock);
+    pthread_mutex_unlock(&aead->lock);
+}
+
+void aead_seal_batch(Aead *aead, AeadPacket *packets, int count) {
+    run_batch(aead, packets, count, 1);
+}
+
+// Sliding window over the stream's control counters, 1 the first time one is seen
+static int control_fresh(Aead *aead, uint64_t value) {
+    uint64_t *highest = &aead->control_highest[value & (AEAD_CONTROL_STREAMS - 1)];
+    uint64_t *seen = &aead->control_seen[value & (AEAD_CONTROL_STREAMS - 1)];
+    uint64_t n = (value / AEAD_CONTROL_STREAMS) + 1;
+    if (n > *highest) {
+        uint64_t shift = n - *highest;
+        *seen = shift < REPLAY_WINDOW ? *seen << shift | 1 : 1;
+        *highest = n;
+        return 1;
+    }
+    uint64_t age = *highest - n;
+    if (age >= REPLAY_WINDOW || (*seen >> age & 1)) return 0;
+    *seen |= 1ULL << age;
+    return 1;
+}
+
+void aead_open_batch(Aead *aead, AeadPacket *packets, int count) {
+    run_batch(aead, packets, count, 0);
+    for (int i = 0; i < count; ++i) {
+        AeadPacket *packet = &packets[i];
+        int type = wire_get_type(packet->data, packet->len);
+        if (packet->ok && type != INIT && type != PUNCH) {
+            if (type != FILE_CHUNK && type != LAST_CHUNK && !control_fresh(aead, packet->value)) packet->ok = 0;
+            else aead->committed = 1;
+        }
+        if (!packet->ok) aead->rejected++;
+    }
+}
+
+int aead_committed(const Aead *aead) {
+    return aead->committed;
+}
+
+// Control packets are few, they get a context of their own so any thread can send them.
+// `stream` picks the counter, one per path.
+size_t aead_seal_control(Aead *aead, int stream, uint8_t *out, const uint8_t *packet, size_t len) {
+    uint64_t counter = __atomic_fetch_add(&aead->control_counter[stream], 1, __ATOMIC_RELAXED);
+    AeadPacket sealed;
+    sealed.data = out;
+    sealed.header_len = wire_put_sealed_header(out, wire_get_type(packet, len), counter * AEAD_CONTROL_STREAMS + stream);
+    memcpy(out + sealed.header_len, packet + 1, len - 1);
+    sealed.len = sealed.header_len + len - 1;
+
+    EVP_CIPHER_CTX *ctx = cipher_ctx(aead->seal_key, 1);
+    int ok = seal(ctx, &sealed);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok == 0 ? sealed.len : 0;
+}
+
+uint64_t aead_rejected(const Aead *aead) {
+    return aead->rejected;
+}
+
+// Both nonces are known: derive the session keys, start the workers the first time
+static void aead_set_keys(Aead *aead) {
+    uint8_t salt[2 * AEAD_NONCE_SIZE];
+    const uint8_t *sender_nonce = aead->is_sender ? aead->local_nonce : aead->peer_nonce;
+    const uint8_t *receiver_nonce = aead->is_sender ? aead->peer_nonce : aead->local_nonce;
+    uint8_t to_receiver[AEAD_KEY_SIZE], to_sender[AEAD_KEY_SIZE];
+
+    memcpy(salt, sender_nonce, AEAD_NONCE_SIZE);
+    memcpy(salt + AEAD_NONCE_SIZE, receiver_nonce, AEAD_NONCE_SIZE);
+    hkdf(aead->psk, aead->psk_len, salt, sizeof(salt), "supra to receiver", to_receiver);
+    hkdf(aead->psk, aead->psk_len, salt, sizeof(salt), "supra to sender", to_sender);
+    memcpy(aead->seal_key, aead->is_sender ? to_receiver : to_sender, AEAD_KEY_SIZE);
+    memcpy(aead->open_key, aead->is_sender ? to_sender : to_receiver, AEAD_KEY_SIZE);
+
+    memset(aead->control_highest, 0, sizeof(aead->control_highest));
+    memset(aead->control_seen, 0, sizeof(aead->control_seen));
+
+    if (aead->keyed) {
+        // Re-keyed before the session was committed
+        for (int i = 0; i <= aead->workers; ++i) {
+            if (!EVP_CipherInit_ex(aead->seal_ctx[i], NULL, NULL, aead->seal_key, NULL, 1) ||
+                !EVP_CipherInit_ex(aead->open_ctx[i], NULL, NULL, aead->open_key, NULL, 0)) {
+                perror_exit("Failed to set up AES-GCM");
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i <= aead->workers; ++i) {
+        aead->seal_ctx[i] = cipher_ctx(aead->seal_key, 1);
+        aead->open_ctx[i] = cipher_ctx(aead->open_key, 0);
+    }
+    for (int i = 0; i < aead->workers; ++i) {
+        aead_worker_t *worker = malloc(sizeof(aead_worker_t));
+        worker->aead = aead;
+        worker->slot = i + 1;
+        start_thread(&aead->threads[i], aead_worker_routine, worker); // not on the pinned transfer core
+        pthread_detach(aead->threads[i]);
+    }
+    aead->keyed = 1;
+}
+
+Aead *aead_new(const uint8_t *psk, size_t psk_len, int is_sender, int workers) {
+    Aead *aead = calloc(1, sizeof(Aead));
+    if (!aead || psk_len == 0 || psk_len > PSK_MAX) {
+        fprintf(stderr, "Invalid pre-shared key\n");
+        exit(EXIT_FAILURE);
+    }
+    aead->is_sender = is_sender;
+    memcpy(aead->psk, psk, psk_len);
+    aead->psk_len = psk_len;
+    aead->workers = workers < 0 ? 0 : workers > AEAD_MAX_WORKERS ? AEAD_MAX_WORKERS : workers;
+    hkdf(psk, psk_len, (const uint8_t *)"supra", 5, "supra handshake", aead->auth_key);
+    if (RAND_bytes(aead->local_nonce, AEAD_NONCE_SIZE) != 1) {
+        perror_exit("Failed to get random bytes");
+    }
+    pthread_mutex_init(&aead->lock, NULL);
+    pthread_cond_init(&aead->work, NULL);
+    pthread_cond_init(&aead->done, NULL);
+    return aead;
+}
+
+/*
+
+--psk-file <path>       pre-shared key, the file's bytes as they are
+--crypto-threads <n>    sealing/opening workers besides the transfer thread
+                        (default: one per other online core)
+
+Returns NULL when no key is given, the transfer then runs in the clear.
+
+*/
+Aead *get_aead(int argc, char *argv[], int is_sender) {
+    const char *psk_path = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 1 ? cores - 1 : 0;
+
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--psk-file") == 0 && i + 1 < argc) {
+            psk_path = argv[++i];
+        } else if (strcmp(argv[i], "--crypto-threads") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        }
+    }
+    if (!psk_path) return NULL;
+
+    uint8_t psk[PSK_MAX];
+    FILE *fp = fopen(psk_path, "rb");
+    if (!fp) {
+        perror_exit("Failed to open the pre-shared key");
+    }
+    size_t psk_len = fread(psk, 1, sizeof(psk), fp);
+    fclose(fp);
+
+    Aead *aead = aead_new(psk, psk_len, is_sender, workers);
+    printf("AES-256-GCM on, %d crypto workers\n", aead->workers);
+    return aead;
+}
+
+// Sender: INIT | nonce | HMAC(INIT | nonce)
+size_t aead_put_init_auth(Aead *aead, uint8_t *init, size_t len) {
+    uint8_t mac[32];
+    memcpy(init + len, aead->local_nonce, AEAD_NONCE_SIZE);
+    len += AEAD_NONCE_SIZE;
+    hmac_sha256(aead->auth_key, sizeof(aead->auth_key), init, len, mac);
+    memcpy(init + len, mac, AEAD_TAG_SIZE);
+    return len + AEAD_TAG_SIZE;
+}
+
+// Receiver: checks the INIT and keys the session for its nonce, unless another one is committed
+int aead_accept_init(Aead *aead, const uint8_t *init, size_t len) {
+    uint8_t mac[32];
+    if (len < 1 + AEAD_NONCE_SIZE + AEAD_TAG_SIZE) return -1;
+    const uint8_t *nonce = init + len - AEAD_TAG_SIZE - AEAD_NONCE_SIZE;
+    hmac_sha256(aead->auth_key, sizeof(aead->auth_key), init, len - AEAD_TAG_SIZE, mac);
+    if (CRYPTO_memcmp(mac, init + len - AEAD_TAG_SIZE, AEAD_TAG_SIZE) != 0) return -1;
+
+    int same = aead->keyed && memcmp(nonce, aead->peer_nonce, AEAD_NONCE_SIZE) == 0;
+    if (same) return 0;
+    if (aead->committed) return -1;
+
+    memcpy(aead->peer_nonce, nonce, AEAD_NONCE_SIZE);
+
+    // Ack: INIT | our nonce | HMAC(sender nonce | our nonce)
+    uint8_t both[2 * AEAD_NONCE_SIZE];
+    memcpy(both, aead->peer_nonce, AEAD_NONCE_SIZE);
+    memcpy(both + AEAD_NONCE_SIZE, aead->local_nonce, AEAD_NONCE_SIZE);
+    hmac_sha256(aead->auth_key, sizeof(aead->auth_key), both, sizeof(both), mac);
+    wire_put_type(aead->ack, INIT);
+    memcpy(aead->ack + 1, aead->local_nonce, AEAD_NONCE_SIZE);
+    memcpy(aead->ack + 1 + AEAD_NONCE_SIZE, mac, AEAD_TAG_SIZE);
+
+    aead_set_keys(aead);
+    return 0;
+}
+
+const uint8_t *aead_ack(const Aead *aead, size_t *len) {
+    *len = sizeof(aead->ack);
+    return aead->ack;
+}
+
+// Sender: checks the receiver's ack and keys the session
+int aead_accept_ack(Aead *aead, const uint8_t *ack, size_t len) {
+    uint8_t both[2 * AEAD_NONCE_SIZE];
+    uint8_t mac[32];
+    if (len != sizeof(aead->ack) || wire_get_type(ack, len) != INIT) return -1;
+
+    memcpy(both, aead->local_nonce, AEAD_NONCE_SIZE);
+    memcpy(both + AEAD_NONCE_SIZE, ack + 1, AEAD_NONCE_SIZE);
+    hmac_sha256(aead->auth_key, sizeof(aead->auth_key), both, sizeof(both), mac);
+    if (CRYPTO_memcmp(mac, ack + 1 + AEAD_NONCE_SIZE, AEAD_TAG_SIZE) != 0) return -1;
+
+    if (!aead->keyed) {
+        memcpy(aead->peer_nonce, ack + 1, AEAD_NONCE_SIZE);
+        aead_set_keys(aead);
+        aead->committed = 1; // the HMAC covers our fresh nonce, it can't be a replay
+    }
+    return 0;
+}
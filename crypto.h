@@ -0,0 +1,41 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AEAD_TAG_SIZE 16
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 16  // handshake nonce each side picks
+#define AEAD_MAX_WORKERS 15 // worker threads, the calling thread also takes a share
+#define AEAD_BATCH 64       // datagrams sealed or opened together
+#define AEAD_SEALED_OVERHEAD (10 + AEAD_TAG_SIZE) // what sealing adds to a control packet at most
+#define AEAD_CONTROL_STREAMS 8 // control counters with a replay window each, a power of 2
+
+typedef struct Aead Aead;
+
+// One datagram in a batch, sealed and opened in place
+typedef struct {
+    uint8_t *data;     // type byte and varint header, then the payload (+ tag when sealed)
+    size_t len;
+    size_t header_len; // sealing: the header in front of the payload
+    int ok;            // opening: it authenticated, data/len is the plain packet
+    uint64_t value;    // opening: the seq number, or a control packet's counter * AEAD_CONTROL_STREAMS + stream
+} AeadPacket;
+
+Aead *get_aead(int argc, char *argv[], int is_sender);
+Aead *aead_new(const uint8_t *psk, size_t psk_len, int is_sender, int workers);
+
+// Handshake
+size_t aead_put_init_auth(Aead *aead, uint8_t *init, size_t len);
+int aead_accept_init(Aead *aead, const uint8_t *init, size_t len);
+const uint8_t *aead_ack(const Aead *aead, size_t *len);
+int aead_accept_ack(Aead *aead, const uint8_t *ack, size_t len);
+int aead_committed(const Aead *aead);
+
+size_t aead_seal_control(Aead *aead, int stream, uint8_t *out, const uint8_t *packet, size_t len);
+void aead_seal_batch(Aead *aead, AeadPacket *packets, int count);
+void aead_open_batch(Aead *aead, AeadPacket *packets, int count);
+uint64_t aead_rejected(const Aead *aead);
+
+#endif // CRYPTO_H
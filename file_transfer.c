@@ -12,38 +12,40 @@
 #include <netinet/in.h>
 #include "file_transfer.h"
 #include "packets.h"
+#include "wire.h"
+#include "tune.h"
 
 #define UDP_PAYLOAD_SIZE 1400 // Optimized. Max UDP payload size (65,507 bytes)
 
-void send_nack(int sockfd, struct sockaddr_in *sender_addr, uint32_t *missing_packets, uint32_t missing_count) {
-    NackPacket nack;
-    nack.type = NACK;
-    nack.count = missing_count;
+// Sends one NACK or ACK, echoing probe id `echo`, with as many of the sorted missing ranges as fit, returns how many did
+size_t send_nack(PathSet *paths, Path *path, PacketType type, uint64_t next_seq, uint64_t echo, const SeqRange *missing, size_t missing_count) {
+    uint8_t nack[WIRE_MAX_PACKET];
+    size_t used;
+    size_t len = wire_put_nack(nack, sizeof(nack), type, next_seq, echo, missing, missing_count, &used);
 
-    for (uint32_t i = 0; i < missing_count; i++) {
-        nack.missing[i] = missing_packets[i];
-    }
-
-    ssize_t sent_bytes = sendto(sockfd, &nack, sizeof(nack), 0, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+    ssize_t sent_bytes = path_send_packet(paths, path, nack, len);
 
     if (sent_bytes < 0) {
         perror("Failed to send NACK");
     }
+    return used;
 }
 
-int send_file_chunk(int sockfd, struct sockaddr_in *dest_addr, socklen_t dest_addr_len, FILE *fp, uint32_t seq_num, size_t frame_size, uint8_t * buffer, NetStats* netStats) {
-    ChunkPacketHeader *header = (ChunkPacketHeader *)buffer;
-    header->type = FILE_CHUNK;
-    header->seq_num = seq_num;
+// Sends chunk_size bytes starting at unit seq_num, the file's tail may come out shorter
+int send_file_chunk(PathSet *paths, Path *path, FILE *fp, uint64_t seq_num, size_t chunk_size, uint8_t * buffer, NetStats* netStats) {
+    uint8_t header[WIRE_CHUNK_HEADER_MAX];
+    size_t header_len = wire_put_chunk_header(header, FILE_CHUNK, seq_num);
 
-    fseek(fp, (uint64_t)seq_num * frame_size, SEEK_SET);
-    size_t bytes_read = fread(buffer + sizeof(ChunkPacketHeader), 1, frame_size, fp);
+    fseek(fp, seq_num * CHUNK_UNIT, SEEK_SET);
+    size_t bytes_read = fread(buffer, 1, chunk_size, fp);
 
     if (bytes_read > 0) {
-        header->data_len = bytes_read;
-        size_t total_size = sizeof(ChunkPacketHeader) + bytes_read;
-        sendto(sockfd, buffer, total_size, 0, (struct sockaddr*) dest_addr, dest_addr_len);
-        netStats->delta_bytes_transfered+=total_size;
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = header_len },
+            { .iov_base = buffer, .iov_len = bytes_read }
+        };
+        paths_send(paths, path, iov, 2);
+        netStats->delta_bytes_transfered += header_len + bytes_read;
     }
 
     return (bytes_read > 0) ? 0 : -1;
@@ -5,8 +5,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "utils.h"
 #include "network.h"
+#include "packets.h"
 
 // Sender functions
 void sender_run(const char *file_path, int argc, char *argv[]);
@@ -14,8 +16,14 @@ void sender_run(const char *file_path, int argc, char *argv[]);
 // Receiver functions
 void receiver_run(int argc, char *argv[]);
 
+// Streaming functions
+void stream_send(PathSet *paths, int in_fd, uint32_t window, NetStats *netStats);
+void stream_receive(PathSet *paths, int out_fd, uint32_t unit_size, uint32_t max_chunk, uint32_t window, NetStats *netStats);
+
 // Utility functions
-void send_nack(int sockfd, struct sockaddr_in *sender_addr, uint32_t *missing_packets, uint32_t missing_count);
-int send_file_chunk(int sockfd, struct sockaddr_in *dest_addr, socklen_t dest_addr_len, FILE *fp, uint32_t seq_num, size_t packet_size, uint8_t *buffer, NetStats * netstats);
+size_t send_nack(PathSet *paths, Path *path, PacketType type, uint64_t next_seq, uint64_t echo, const SeqRange *missing, size_t missing_count);
+ssize_t receive_file_chunk(FILE *fp, uint64_t *received_units, uint64_t file_size, uint32_t unit, uint32_t max_chunk, const uint8_t *packet, size_t len);
+size_t collect_missing(const uint64_t *received_units, uint64_t from, uint64_t to, SeqRange *ranges, size_t max, uint64_t *next);
+int send_file_chunk(PathSet *paths, Path *path, FILE *fp, uint64_t seq_num, size_t chunk_size, uint8_t *buffer, NetStats * netstats);
 
 #endif // FILE_TRANSFER_H
@@ -8,11 +8,22 @@
 
 void print_usage(const char *prog_name) {
     printf("Usage:\n");
-    printf("  %s send <file_path> [options]\n", prog_name);
+    printf("  %s send <file_path|-> [options]\n", prog_name);
     printf("  %s receive [options]\n", prog_name);
     printf("\nOptions:\n");
-    printf("  --dest-ip <ip>          Destination IP address\n");
+    printf("  --dest-ip <ip>          Destination IPv4 or IPv6 address\n");
     printf("  --dest-port <port>      Destination port\n");
+    printf("  --path <local>=<remote> Add a path, e.g. 10.0.0.2=198.51.100.7:4000 or =[2001:db8::7]:4000,\n");
+    printf("                          repeat for multipath (same order on both sides)\n");
+    printf("  --window <bytes>        Streaming window when sending from stdin (default 8388608)\n");
+    printf("  --chunk-size <bytes>    Fixed chunk size, a multiple of 128 (default: tuned to the measured loss)\n");
+    printf("  --mtu <bytes>           Path MTU to size chunks for (default: asked from the kernel)\n");
+    printf("  --output <path|->       Where to write received data (default received_file)\n");
+    printf("  --low-latency           Busy poll the sockets and keep chunk buffers NUMA-local\n");
+    printf("  --cpu <n>               Pin the send/receive thread to core n\n");
+    printf("  --stats-cpu <n>         Pin the stats thread to core n\n");
+    printf("  --psk-file <path>       Encrypt and authenticate with AES-256-GCM, keyed from this pre-shared key (same on both sides)\n");
+    printf("  --crypto-threads <n>    Threads sealing/opening besides the transfer thread (default: one per other core)\n");
     printf("  --help                  Display this help message\n");
 }
 
@@ -3,32 +3,99 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include "network.h"
 #include "utils.h"
 #include "packets.h"
+#include "wire.h"
+#include "tune.h"
 
-#define PUNCH_ATTEMPT_MSG "ping"
-#define PUNCH_OK_MSG "pong"
 
 
-int create_and_bind_udp_socket(struct sockaddr_in *local_addr) {
+static socklen_t sockaddr_len(const struct sockaddr_storage *addr) {
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static int get_port(const struct sockaddr_storage *addr) {
+    if (addr->ss_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+    return ntohs(((struct sockaddr_in *)addr)->sin_port);
+}
+
+static void set_port(struct sockaddr_storage *addr, int port) {
+    if (addr->ss_family == AF_INET6) ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    else ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+static int sockaddr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return 0;
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a, *b6 = (const struct sockaddr_in6 *)b;
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *)a, *b4 = (const struct sockaddr_in *)b;
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+void format_address(const struct sockaddr_storage *addr, char *buf, size_t len) {
+    char ip[INET6_ADDRSTRLEN] = "?";
+    if (addr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, ip, sizeof(ip));
+        snprintf(buf, len, "[%s]:%d", ip, get_port(addr));
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, ip, sizeof(ip));
+        snprintf(buf, len, "%s:%d", ip, get_port(addr));
+    }
+}
+
+// "1.2.3.4", "1.2.3.4:port", "::1", "[::1]" or "[::1]:port". Returns the port, 0 if none, -1 if invalid.
+static int parse_endpoint(const char *str, struct sockaddr_storage *addr) {
+    char host[INET6_ADDRSTRLEN] = {0};
+    int port = 0;
+    const char *colon = strchr(str, ':');
+
+    if (str[0] == '[') {
+        const char *end = strchr(str, ']');
+        if (!end || end - str - 1 >= (long)sizeof(host)) return -1;
+        memcpy(host, str + 1, end - str - 1);
+        if (end[1] == ':') port = atoi(end + 2);
+    } else if (colon && !strchr(colon + 1, ':')) {
+        if (colon - str >= (long)sizeof(host)) return -1;
+        memcpy(host, str, colon - str);
+        port = atoi(colon + 1);
+    } else {
+        strncpy(host, str, sizeof(host) - 1);
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+    if (inet_pton(AF_INET, host, &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host, &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+    } else {
+        return -1;
+    }
+    if (port < 0 || port > 65535) return -1;
+    set_port(addr, port);
+    return port;
+}
+
+
+int create_and_bind_udp_socket(struct sockaddr_storage *local_addr) {
     int sockfd;
     socklen_t addr_len = sizeof(*local_addr);
 
     // Create UDP socket
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((sockfd = socket(local_addr->ss_family, SOCK_DGRAM, 0)) < 0) {
         perror_exit("Socket creation failed");
     }
 
-    // Initialize local address structure
-    memset(local_addr, 0, sizeof(*local_addr));
-    local_addr->sin_family = AF_INET;
-    local_addr->sin_addr.s_addr = htonl(INADDR_ANY);
-    local_addr->sin_port = htons(0); // Let OS choose the port
-
-    // Bind the socket to the local address
-    if (bind(sockfd, (struct sockaddr*)local_addr, sizeof(*local_addr)) < 0) {
+    // Bind the socket to the local address, the OS chooses the port
+    set_port(local_addr, 0);
+    if (bind(sockfd, (struct sockaddr*)local_addr, sockaddr_len(local_addr)) < 0) {
         perror_exit("Bind failed");
     }
 
@@ -36,127 +103,813 @@ int create_and_bind_udp_socket(struct sockaddr_in *local_addr) {
         perror_exit("getsockname() failed");
     }
 
-    printf("UDP socket bound to port: %d\n", ntohs(local_addr->sin_port));
+    printf("UDP socket bound to port: %d\n", get_port(local_addr));
 
     return sockfd;
 }
 
 
-void get_destination(struct sockaddr_in *dest_addr, int argc, char *argv[]) {
-    char dest_ip[INET_ADDRSTRLEN] = {0};
+/*
+
+A single path comes from --dest-ip/--dest-port. Multipath is one
+--path <local-ip>=<remote-ip>[:port] per path, local-ip may be empty.
+Both sides must list their paths in the same order. Whatever is missing
+is asked for on stdin, unless stdin is the data (can_prompt 0).
+
+*/
+static void missing_address(int can_prompt) {
+    if (can_prompt) return;
+    fprintf(stderr, "Streaming from stdin needs --dest-ip and --dest-port, or a port in every --path\n");
+    exit(EXIT_FAILURE);
+}
+
+void get_paths(PathSet *paths, int argc, char *argv[], int can_prompt) {
+    char dest_ip[INET6_ADDRSTRLEN + 2] = {0};
     int dest_port = 0;
+    const char *specs[MAX_PATHS];
+    int spec_count = 0;
 
     for (int i = 0; i < argc; ++i) {
         if (strcmp(argv[i], "--dest-ip") == 0 && i + 1 < argc) {
-            strncpy(dest_ip, argv[++i], INET_ADDRSTRLEN - 1);
+            strncpy(dest_ip, argv[++i], sizeof(dest_ip) - 1);
         } else if (strcmp(argv[i], "--dest-port") == 0 && i + 1 < argc) {
             dest_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            if (spec_count == MAX_PATHS) {
+                fprintf(stderr, "At most %d paths\n", MAX_PATHS);
+                exit(EXIT_FAILURE);
+            }
+            specs[spec_count++] = argv[++i];
         }
     }
 
-    if (dest_ip[0] == '\0') {
-        printf("Enter destination IP: ");
-        scanf("%s", dest_ip);
+    memset(paths, 0, sizeof(*paths));
+
+    if (spec_count == 0) {
+        if (dest_ip[0] == '\0') {
+            missing_address(can_prompt);
+            printf("Enter destination IP: ");
+            scanf("%47s", dest_ip);
+        }
+
+        Path *path = &paths->paths[paths->count++];
+        if (parse_endpoint(dest_ip, &path->dest_addr) < 0) {
+            fprintf(stderr, "Invalid address\n");
+            exit(EXIT_FAILURE);
+        }
+        if (dest_port) set_port(&path->dest_addr, dest_port); // --dest-port wins over ip:port
+        path->local_addr.ss_family = path->dest_addr.ss_family; // any address
     }
 
-    if (dest_port == 0) {
-        printf("Enter destination port: ");
-        scanf("%d", &dest_port);
+    for (int i = 0; i < spec_count; ++i) {
+        char local_ip[INET6_ADDRSTRLEN + 2] = {0};
+        const char *remote = strchr(specs[i], '=');
+        if (!remote || remote - specs[i] >= (long)sizeof(local_ip)) {
+            fprintf(stderr, "Invalid path %s, expected <local-ip>=<remote-ip>[:port]\n", specs[i]);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(local_ip, specs[i], remote - specs[i]);
+
+        Path *path = &paths->paths[paths->count++];
+        if (parse_endpoint(remote + 1, &path->dest_addr) < 0 ||
+            (local_ip[0] && parse_endpoint(local_ip, &path->local_addr) < 0)) {
+            fprintf(stderr, "Invalid address in path %s\n", specs[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (!local_ip[0]) {
+            path->local_addr.ss_family = path->dest_addr.ss_family;
+        } else if (path->local_addr.ss_family != path->dest_addr.ss_family) {
+            fprintf(stderr, "Path %s mixes IPv4 and IPv6\n", specs[i]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    memset(dest_addr, 0, sizeof(*dest_addr));
-    dest_addr->sin_family = AF_INET;
-    if (inet_pton(AF_INET, dest_ip, &dest_addr->sin_addr) <= 0) {
-        fprintf(stderr, "Invalid address\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        path->sockfd = create_and_bind_udp_socket(&path->local_addr);
+        path->dest_addr_len = sockaddr_len(&path->dest_addr);
+        path->weight = 1;
+    }
+
+    for (int i = 0; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        int port = get_port(&path->dest_addr);
+        if (port == 0) {
+            missing_address(can_prompt);
+            if (paths->count == 1) printf("Enter destination port: ");
+            else printf("Enter destination port for path %d: ", i);
+            scanf("%d", &port);
+            set_port(&path->dest_addr, port);
+        }
+    }
+}
+
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#define BUSY_POLL_US 50 // how long the kernel and paths_recv spin before sleeping
+
+/*
+
+Opt-in low-latency profile, for dedicated boxes:
+  --low-latency     busy poll the sockets, NUMA-local chunk buffers
+  --cpu <n>         pin the send/receive (main) thread
+  --stats-cpu <n>   pin the stats thread
+Pin before allocating buffers, they go on the node of the pinned core.
+Helper threads start through start_thread and keep the process's cores.
+
+*/
+void set_low_latency(PathSet *paths, NetStats *netStats, int argc, char *argv[]) {
+    int cpu = -1;
+    netStats->stats_cpu = -1;
+    netStats->last_polled = 0;
+    netStats->last_slept = 0;
+
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--low-latency") == 0) {
+            paths->low_latency = 1;
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-cpu") == 0 && i + 1 < argc) {
+            netStats->stats_cpu = atoi(argv[++i]);
+        }
+    }
+
+    if (cpu >= 0 && pin_thread(cpu) == 0) {
+        printf("Transfer thread pinned to CPU %d\n", cpu);
+    }
+    if (!paths->low_latency) return;
+
+    // Raising these past the sysctl defaults takes CAP_NET_ADMIN, paths_recv still spins without them
+    int busy_poll = BUSY_POLL_US, prefer = 1;
+    int i;
+    for (i = 0; i < paths->count; ++i) {
+        int fd = paths->paths[i].sockfd;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+            perror("Kernel busy polling unavailable");
+            break;
+        }
+    }
+    if (i == paths->count) printf("Low-latency profile: busy polling %d us\n", BUSY_POLL_US);
+    else printf("Low-latency profile: spinning only\n");
+}
+
+
+#define QUEUE_SLOT 65536 // any datagram fits
+
+/*
+
+Encrypted, chunks are sealed and opened AEAD_BATCH at a time so the
+crypto workers each get a share. paths_send only queues a chunk, it goes
+out when the queue is full or on paths_flush, which the send loops call
+before they wait. paths_recv drains what the sockets have, opens it in
+one go and hands the packets out one by one, dropping forgeries.
+
+*/
+typedef struct PacketQueue {
+    AeadPacket packets[AEAD_BATCH];
+    Path *paths[AEAD_BATCH];
+    uint8_t *slots; // AEAD_BATCH * QUEUE_SLOT bytes
+    int count;
+    int next;       // recv: next packet to hand out
+} PacketQueue;
+
+static PacketQueue *queue_new(int numa_local) {
+    PacketQueue *queue = calloc(1, sizeof(PacketQueue));
+    if (!queue || !(queue->slots = buffer_alloc((size_t)AEAD_BATCH * QUEUE_SLOT, numa_local))) {
+        perror_exit("Failed to allocate packet queue");
     }
-    dest_addr->sin_port = htons(dest_port);
+    for (int i = 0; i < AEAD_BATCH; ++i) queue->packets[i].data = queue->slots + (size_t)i * QUEUE_SLOT;
+    return queue;
 }
 
+// Before paths_setup_chunks, the tag takes room from every chunk
+void paths_set_aead(PathSet *paths, Aead *aead) {
+    paths->aead = aead;
+    if (!aead) return;
+    paths->send_queue = queue_new(paths->low_latency);
+    paths->recv_queue = queue_new(paths->low_latency);
+}
+
+
+#define PUNCH_FIRST_MS 10        // first probe interval, doubled after every probe
+#define PUNCH_MAX_INTERVAL_MS 500 // probe at least this often
+#define PUNCH_TIMEOUT_MS 10000    // give up on the peer after this long
+#define PUNCH_GRACE_MS 250        // sender: time the other paths get before data starts without them
+
+/*
+
+Connection setup, a single exchange that punches the holes and carries
+the INIT:
+
+sender                        receiver
+-> INIT ->                    <- PUNCH <-
+<- INIT (bare, ack) <-
 
-#define MAX_ATTEMPTS 10
+With --psk-file the INIT also carries the sender's handshake nonce and
+the ack the receiver's, see crypto.c.
 
+Both sides probe every path right away, then at doubling intervals. The
+sender's probe is the INIT itself, and it sends it again as soon as a
+PUNCH shows the receiver's side is open. A path is confirmed when its
+INIT gets acked, data starts flowing then. Paths still closed
+PUNCH_GRACE_MS after the first one opened are probed on by a background
+thread, and join the transfer whenever their INIT gets acked.
+
+*/
 
 typedef struct {
-    int sockfd;
-    struct sockaddr_in dest_addr;
-    volatile int state; // Shared state: 0 (pending), 1 (success), -1 (timeout)
-} udp_punch_context_t;
-
-
-void* udp_hole_punch_listen_thread(void* arg) {
-    udp_punch_context_t* pstate = (udp_punch_context_t*)arg;
-    char buf[16] = {0};
-    struct sockaddr_in recv_addr;
-    socklen_t recv_len = sizeof(recv_addr);
-
-    while (pstate->state != 2) {
-        int n = recvfrom(pstate->sockfd, buf, sizeof(buf)-1, 0, (struct sockaddr*)&recv_addr, &recv_len);
-        if (n > 0) {
-            buf[n] = '\0';
-            if (strcmp(buf, PUNCH_ATTEMPT_MSG) == 0 &&
-                recv_addr.sin_addr.s_addr == pstate->dest_addr.sin_addr.s_addr &&
-                recv_addr.sin_port == pstate->dest_addr.sin_port) {
-                pstate->state = 1;
-                printf("received ping\n");
-            } else if(strcmp(buf, PUNCH_OK_MSG) == 0 &&
-                recv_addr.sin_addr.s_addr == pstate->dest_addr.sin_addr.s_addr &&
-                recv_addr.sin_port == pstate->dest_addr.sin_port){
-                pstate->state = 2;  // Hole punched successfully
-                printf("received pong\n");
-                return NULL;
+    uint64_t next_probe;
+    uint64_t interval;
+} punch_timer_t;
+
+static void punch_timers_init(punch_timer_t *timers, int count, uint64_t now) {
+    for (int i = 0; i < count; ++i) {
+        timers[i].next_probe = now;
+        timers[i].interval = PUNCH_FIRST_MS;
+    }
+}
+
+static void punch_send(Path *path, punch_timer_t *timer, const uint8_t *probe, size_t len, uint64_t now) {
+    sendto(path->sockfd, probe, len, 0, (struct sockaddr *)&path->dest_addr, path->dest_addr_len);
+    timer->next_probe = now + timer->interval;
+    timer->interval = timer->interval * 2 < PUNCH_MAX_INTERVAL_MS ? timer->interval * 2 : PUNCH_MAX_INTERVAL_MS;
+}
+
+// Probes the paths that are due, returns how long until the next one is
+static int punch_due(PathSet *paths, punch_timer_t *timers, const int *confirmed, const uint8_t *probe, size_t len) {
+    uint64_t now = get_timestamp_millis();
+    uint64_t wait = PUNCH_MAX_INTERVAL_MS;
+    for (int i = 0; i < paths->count; ++i) {
+        if (confirmed && confirmed[i]) continue;
+        if (timers[i].next_probe <= now) punch_send(&paths->paths[i], &timers[i], probe, len, now);
+        if (timers[i].next_probe - now < wait) wait = timers[i].next_probe - now;
+    }
+    return wait;
+}
+
+// Receiver: tell the sender its INIT arrived. Encrypted, the INIT has to authenticate (-1 if it
+// doesn't) and the ack carries our half of the handshake.
+int path_ack_init(PathSet *paths, Path *path, const uint8_t *init, size_t init_len) {
+    uint8_t bare[1];
+    const uint8_t *ack = bare;
+    size_t len = sizeof(bare);
+    wire_put_type(bare, INIT);
+    if (paths->aead) {
+        if (aead_accept_init(paths->aead, init, init_len) < 0) return -1;
+        ack = aead_ack(paths->aead, &len);
+    }
+    sendto(path->sockfd, ack, len, 0, (struct sockaddr *)&path->dest_addr, path->dest_addr_len);
+    return 0;
+}
+
+typedef struct {
+    PathSet *paths;
+    uint8_t *init;
+    size_t init_len;
+    punch_timer_t timers[MAX_PATHS];
+} late_paths_t;
+
+// Sender: pending path i was confirmed, move it to the end of the active ones
+static void late_path_join(late_paths_t *late, int i) {
+    PathSet *paths = late->paths;
+    int slot = paths->count;
+    Path path = paths->paths[i];
+    punch_timer_t timer = late->timers[i];
+    paths->paths[i] = paths->paths[slot];
+    late->timers[i] = late->timers[slot];
+    paths->paths[slot] = path;
+    late->timers[slot] = timer;
+
+    paths->pending--;
+    __atomic_store_n(&paths->count, slot + 1, __ATOMIC_RELEASE); // the transfer picks it up from here
+
+    char addr[INET6_ADDRSTRLEN + 8];
+    format_address(&path.dest_addr, addr, sizeof(addr));
+    printf("Path to %s confirmed late, now path %d\n", addr, slot);
+}
+
+// Sender: the pending paths sit past paths->count, only this thread touches them
+static void *late_paths_routine(void *arg) {
+    late_paths_t *late = arg;
+    PathSet *paths = late->paths;
+    uint8_t packet[WIRE_MAX_PACKET];
+
+    while (paths->pending > 0) {
+        int first = paths->count, end = first + paths->pending;
+        struct pollfd fds[MAX_PATHS];
+        uint64_t now = get_timestamp_millis();
+        uint64_t wait = PUNCH_MAX_INTERVAL_MS;
+        for (int i = first; i < end; ++i) {
+            if (late->timers[i].next_probe <= now) punch_send(&paths->paths[i], &late->timers[i], late->init, late->init_len, now);
+            if (late->timers[i].next_probe - now < wait) wait = late->timers[i].next_probe - now;
+            fds[i - first] = (struct pollfd){ .fd = paths->paths[i].sockfd, .events = POLLIN };
+        }
+        if (poll(fds, end - first, wait) <= 0) continue;
+
+        for (int i = first; i < end; ++i) {
+            if (!(fds[i - first].revents & POLLIN)) continue;
+            Path *path = &paths->paths[i];
+            struct sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            ssize_t n = recvfrom(path->sockfd, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+            if (n <= 0 || !sockaddr_equal(&addr, &path->dest_addr)) continue;
+
+            int type = wire_get_type(packet, n);
+            if (type == INIT && (paths->aead ? aead_accept_ack(paths->aead, packet, n) == 0 : n == 1)) {
+                late_path_join(late, i);
+                break; // the slots moved
             }
+            // A PUNCH or PATH_REPORT: the receiver's side is open
+            if (type == PUNCH || type == PATH_REPORT) punch_send(path, &late->timers[i], late->init, late->init_len, get_timestamp_millis());
         }
     }
+
+    free(late->init);
+    free(late);
     return NULL;
 }
 
+// Sender: punch every path with the encoded INIT until it's acked. The paths that stay closed
+// are left pending after paths->count, and keep being probed in the background.
+void paths_connect(PathSet *paths, const uint8_t *init, size_t init_len) {
+    punch_timer_t timers[MAX_PATHS];
+    int confirmed[MAX_PATHS] = {0};
+    int confirmed_count = 0;
+    uint64_t start = get_timestamp_millis();
+    uint64_t first = 0;
+    uint8_t packet[WIRE_MAX_PACKET];
+    Path *from;
+
+    punch_timers_init(timers, paths->count, start);
+    while (confirmed_count < paths->count) {
+        uint64_t now = get_timestamp_millis();
+        if (confirmed_count == 0 && now - start >= PUNCH_TIMEOUT_MS) break;
+        if (confirmed_count > 0 && now - first >= PUNCH_GRACE_MS) break;
+
+        int wait = punch_due(paths, timers, confirmed, init, init_len);
+        if (confirmed_count > 0 && first + PUNCH_GRACE_MS - now < (uint64_t)wait) wait = first + PUNCH_GRACE_MS - now;
+        ssize_t n = paths_recv(paths, packet, sizeof(packet), wait, &from);
+        if (n <= 0) continue;
+
+        int i = from - paths->paths;
+        int type = wire_get_type(packet, n);
+        if (confirmed[i]) continue;
+        if (type == PUNCH) {
+            // The receiver's side just opened, no need to wait for the next probe
+            punch_send(from, &timers[i], init, init_len, get_timestamp_millis());
+        } else if (type == INIT && (paths->aead ? aead_accept_ack(paths->aead, packet, n) == 0 : n == 1)) {
+            confirmed[i] = 1;
+            confirmed_count++;
+            if (!first) first = get_timestamp_millis();
+            printf("Path %d confirmed after %lu ms\n", i, get_timestamp_millis() - start);
+        }
+    }
+
+    if (confirmed_count == 0) {
+        fprintf(stderr, "Failed to reach the receiver after %d seconds.\n", PUNCH_TIMEOUT_MS / 1000);
+        exit(EXIT_FAILURE);
+    }
 
-int udp_hole_punch(int sockfd, struct sockaddr_in *dest_addr) {
-    udp_punch_context_t pstate = {sockfd, *dest_addr, 0};
+    // Confirmed paths first, in order, then the pending ones
+    Path sorted[MAX_PATHS];
+    late_paths_t *late = calloc(1, sizeof(*late));
+    if (!late || !(late->init = malloc(init_len))) {
+        perror_exit("Failed to allocate the late path prober");
+    }
+    int open_count = 0, pending_count = 0;
+    for (int i = 0; i < paths->count; ++i) {
+        if (confirmed[i]) sorted[open_count++] = paths->paths[i];
+    }
+    for (int i = 0; i < paths->count; ++i) {
+        if (confirmed[i]) continue;
+        Path *path = &paths->paths[i];
+        char addr[INET6_ADDRSTRLEN + 8];
+        format_address(&path->dest_addr, addr, sizeof(addr));
+        fprintf(stderr, "Path %d to %s not confirmed yet, still probing it\n", i, addr);
+        late->timers[open_count + pending_count] = timers[i];
+        sorted[open_count + pending_count++] = *path;
+    }
+    memcpy(paths->paths, sorted, paths->count * sizeof(Path));
+    paths->count = open_count;
+    paths->pending = pending_count;
+    if (paths->recv_queue) paths->recv_queue->count = 0; // stale acks, and their paths moved
+
+    if (pending_count == 0) {
+        free(late->init);
+        free(late);
+        return;
+    }
+    late->paths = paths;
+    memcpy(late->init, init, init_len);
+    late->init_len = init_len;
     pthread_t thread;
+    start_thread(&thread, late_paths_routine, late);
+    pthread_detach(thread);
+}
 
-    // Start listening thread
-    pthread_create(&thread, NULL, udp_hole_punch_listen_thread, &pstate);
+/*
+
+Receiver: punch every path until an INIT arrives on one of them, and ack
+it. Later INITs get acked by the receive loops. Encrypted, the INIT may
+be a replay, so this goes on until a sealed packet opens under the keys
+of the INIT it acked last, and leaves that packet for the receive loop.
+Once an INIT was acked there is no timeout: the sender may have nothing
+to send for a while, and it seals a CHECK as soon as it's connected.
+
+*/
+void paths_accept(PathSet *paths, InitPacket *init) {
+    punch_timer_t timers[MAX_PATHS];
+    uint64_t start = get_timestamp_millis();
+    uint8_t punch[1];
+    uint8_t packet[WIRE_MAX_PACKET];
+    Path *from;
+    int warned = 0;
+    int received = 0;
+
+    wire_put_type(punch, PUNCH);
+    punch_timers_init(timers, paths->count, start);
+    while (received || get_timestamp_millis() - start < PUNCH_TIMEOUT_MS) {
+        int wait = punch_due(paths, timers, NULL, punch, sizeof(punch));
+        ssize_t n = paths_recv(paths, packet, sizeof(packet), wait, &from);
+        if (n > 0 && paths->aead && aead_committed(paths->aead)) {
+            paths->recv_queue->next--; // still the receive loop's
+            return;
+        }
 
-    for (int attempts = 0; attempts < MAX_ATTEMPTS; ++attempts) {
+        InitPacket candidate;
+        if (n <= 0 || wire_get_init(packet, n, &candidate) < 0) continue;
 
-        if (pstate.state == 0) {
-            sendto(sockfd, PUNCH_ATTEMPT_MSG, strlen(PUNCH_ATTEMPT_MSG), 0, (struct sockaddr*)dest_addr, sizeof(*dest_addr));
-        } else if (pstate.state == 1){
-            sendto(sockfd, PUNCH_OK_MSG, strlen(PUNCH_OK_MSG), 0, (struct sockaddr*)dest_addr, sizeof(*dest_addr));
-        } else if (pstate.state == 2) {
-            sendto(sockfd, PUNCH_OK_MSG, strlen(PUNCH_OK_MSG), 0, (struct sockaddr*)dest_addr, sizeof(*dest_addr));
-            printf("Hole punched!\n");
-            break;
+        if ((candidate.flags & INIT_AEAD) && !paths->aead) {
+            fprintf(stderr, "The sender encrypts, pass the same --psk-file\n");
+            exit(EXIT_FAILURE);
+        }
+        // With a key, a cleartext or forged INIT must not downgrade the transfer
+        if (paths->aead && (!(candidate.flags & INIT_AEAD) || path_ack_init(paths, from, packet, n) < 0)) {
+            if (!warned++) fprintf(stderr, "Ignoring an INIT that doesn't match our --psk-file\n");
+            continue;
+        }
+        if (!paths->aead) path_ack_init(paths, from, packet, n);
+
+        *init = candidate;
+        if (!received++) printf("INIT received after %lu ms\n", get_timestamp_millis() - start);
+        if (!paths->aead) return;
+    }
+
+    fprintf(stderr, "Failed to reach the sender after %d seconds.\n", PUNCH_TIMEOUT_MS / 1000);
+    exit(EXIT_FAILURE);
+}
+
+
+#define DEFAULT_MTU 1500       // when the kernel doesn't know the path MTU
+#define PATH_REPORT_MS 100     // receiver reports per-path counters this often
+#define PATH_EWMA 0.3          // weight of the newest loss/capacity sample
+#define PATH_LOSS_LOW 0.01     // below this loss a path gets probed for more
+#define PATH_PROBE_GAIN 0.25   // headroom of the path being probed, in average path rates
+#define PATH_MIN_RATE 65536.0  // bytes/s every path keeps so it stays measured
+
+// The kernel's idea of the path MTU towards dest_addr, from a throwaway connected socket
+static uint32_t path_mtu(const Path *path) {
+    int mtu = DEFAULT_MTU;
+    socklen_t len = sizeof(mtu);
+    int fd = socket(path->dest_addr.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) return DEFAULT_MTU;
+
+    if (connect(fd, (struct sockaddr *)&path->dest_addr, path->dest_addr_len) == 0) {
+        if (path->dest_addr.ss_family == AF_INET6) getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+        else getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len);
+    }
+    close(fd);
+    return mtu > 0 ? mtu : DEFAULT_MTU;
+}
+
+// Sender: start every path at the largest unfragmented chunk. mtu 0 asks the kernel, chunk_size 0 tunes it live.
+void paths_setup_chunks(PathSet *paths, uint32_t mtu, uint32_t chunk_size) {
+    for (int i = 0; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        uint32_t path_mtu_bytes = mtu ? mtu : path_mtu(path);
+        path->ip_header = path->dest_addr.ss_family == AF_INET6 ? 48 : 28;
+        uint32_t overhead = path->ip_header + WIRE_CHUNK_HEADER_MAX + (paths->aead ? AEAD_TAG_SIZE : 0);
+
+        uint32_t payload = path_mtu_bytes > overhead + CHUNK_UNIT ? path_mtu_bytes - overhead : CHUNK_UNIT;
+        payload = payload / CHUNK_UNIT * CHUNK_UNIT;
+        path->mtu_payload = payload < CHUNK_MAX ? payload : CHUNK_MAX;
+
+        path->tune_chunk = chunk_size == 0;
+        path->chunk_size = chunk_size ? chunk_size : path->mtu_payload;
+        printf("Path %d: mtu %u, chunk size %u%s\n", i, path_mtu_bytes, path->chunk_size, path->tune_chunk ? " (auto)" : "");
+    }
+}
+
+/*
+
+Sender scheduling: each path gets new chunks in proportion to its weight
+(smooth weighted round robin). A path's weight is the rate the receiver
+saw on it, scaled down by its loss. The clean paths take turns being
+probed: for one report round a path gets headroom on top of its rate,
+a share of the average path's rate, so it can grow into spare capacity
+even from the PATH_MIN_RATE floor. Giving it to all of them at once
+would cancel out in the split. Weights are bytes/s and paths pick whole
+chunks of their own size, so the round robin runs on chunks/s, weight /
+chunk_size. A path whose socket
+buffer is full is skipped for the next one, so no link sits idle.
+
+*/
+Path *paths_pick(PathSet *paths) {
+    if (paths->count == 1) return &paths->paths[0];
+
+    Path *best = NULL;
+    double total = 0;
+    for (int i = 0; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        double rate = path->weight / path->chunk_size;
+        path->credit += rate;
+        total += rate;
+        if (!best || path->credit > best->credit) best = path;
+    }
+    best->credit -= total;
+    return best;
+}
+
+// Least lossy path, the fastest one among the clean ones. Used for retransmissions.
+Path *paths_best(PathSet *paths) {
+    Path *best = &paths->paths[0];
+    for (int i = 1; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        if (path->loss < PATH_LOSS_LOW && best->loss < PATH_LOSS_LOW) {
+            if (path->capacity > best->capacity) best = path;
+        } else if (path->loss < best->loss) {
+            best = path;
+        }
+    }
+    return best;
+}
+
+// A chunk is sent as iov[0] = header, iov[1] = data, iov[2] = tag when sealed
+static ssize_t path_sendmsg(Path *path, const struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg = {
+        .msg_name = &path->dest_addr,
+        .msg_namelen = path->dest_addr_len,
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt
+    };
+    ssize_t n = sendmsg(path->sockfd, &msg, flags);
+    if (n > 0) {
+        path->sent_packets++;
+        path->sent_bytes += n;
+        path->sent_header_bytes += n - iov[1].iov_len;
+    }
+    return n;
+}
+
+static ssize_t paths_transmit(PathSet *paths, Path *path, const struct iovec *iov, int iovcnt) {
+    if (paths->count == 1) return path_sendmsg(path, iov, iovcnt, 0);
+
+    ssize_t n = path_sendmsg(path, iov, iovcnt, MSG_DONTWAIT);
+    for (int i = 0; n < 0 && i < paths->count; ++i) {
+        if (&paths->paths[i] != path) n = path_sendmsg(&paths->paths[i], iov, iovcnt, MSG_DONTWAIT);
+    }
+    if (n < 0) n = path_sendmsg(path, iov, iovcnt, 0); // every path is full, wait for ours
+    return n;
+}
+
+ssize_t paths_send(PathSet *paths, Path *path, const struct iovec *iov, int iovcnt) {
+    if (!paths->aead) return paths_transmit(paths, path, iov, iovcnt);
+
+    PacketQueue *queue = paths->send_queue;
+    AeadPacket *packet = &queue->packets[queue->count];
+    packet->len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(packet->data + packet->len, iov[i].iov_base, iov[i].iov_len);
+        packet->len += iov[i].iov_len;
+    }
+    packet->header_len = iov[0].iov_len;
+    queue->paths[queue->count++] = path;
+
+    ssize_t n = packet->len;
+    if (queue->count == AEAD_BATCH) paths_flush(paths);
+    return n;
+}
+
+// Seal and send whatever paths_send queued
+void paths_flush(PathSet *paths) {
+    PacketQueue *queue = paths->send_queue;
+    if (!paths->aead || queue->count == 0) return;
+
+    aead_seal_batch(paths->aead, queue->packets, queue->count);
+    for (int i = 0; i < queue->count; ++i) {
+        AeadPacket *packet = &queue->packets[i];
+        if (!packet->ok) continue;
+        struct iovec iov[3] = {
+            { .iov_base = packet->data, .iov_len = packet->header_len },
+            { .iov_base = packet->data + packet->header_len, .iov_len = packet->len - packet->header_len - AEAD_TAG_SIZE },
+            { .iov_base = packet->data + packet->len - AEAD_TAG_SIZE, .iov_len = AEAD_TAG_SIZE }
+        };
+        paths_transmit(paths, queue->paths[i], iov, 3);
+    }
+    queue->count = 0;
+}
+
+#if MAX_PATHS > AEAD_CONTROL_STREAMS
+#error "every path needs a control stream of its own"
+#endif
+
+// Control packets, from any thread. Encrypted, each is sealed on its own, counted per path.
+ssize_t path_send_packet(PathSet *paths, Path *path, const uint8_t *packet, size_t len) {
+    uint8_t sealed[WIRE_MAX_PACKET + AEAD_SEALED_OVERHEAD];
+    if (paths->aead) {
+        len = aead_seal_control(paths->aead, path - paths->paths, sealed, packet, len);
+        packet = sealed;
+    }
+    return sendto(path->sockfd, packet, len, 0, (struct sockaddr *)&path->dest_addr, path->dest_addr_len);
+}
+
+// Waits until a path socket, or extra_fd unless it's -1, is readable. Low latency spins a while
+// before sleeping. Counts the wait as polled or slept, returns poll()'s result.
+int paths_wait(PathSet *paths, int extra_fd, int timeout_ms, int *extra_ready) {
+    struct pollfd fds[MAX_PATHS + 1];
+    int nfds = paths->count;
+    for (int i = 0; i < paths->count; ++i) {
+        fds[i].fd = paths->paths[i].sockfd;
+        fds[i].events = POLLIN;
+    }
+    if (extra_fd >= 0) {
+        fds[nfds].fd = extra_fd;
+        fds[nfds++].events = POLLIN;
+    }
+
+    int ready = 0;
+    if (paths->low_latency && timeout_ms != 0) {
+        struct timespec spin_start, now;
+        long spun_us;
+        clock_gettime(CLOCK_MONOTONIC, &spin_start);
+        do {
+            ready = poll(fds, nfds, 0);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            spun_us = (now.tv_sec - spin_start.tv_sec) * 1000000L + (now.tv_nsec - spin_start.tv_nsec) / 1000L;
+        } while (ready == 0 && spun_us < BUSY_POLL_US);
+    }
+    if (ready > 0) {
+        paths->polled++;
+    } else if (ready == 0) {
+        paths->slept++;
+        ready = poll(fds, nfds, timeout_ms);
+    }
+    if (extra_ready) *extra_ready = ready > 0 && extra_fd >= 0 && (fds[nfds - 1].revents & (POLLIN | POLLHUP));
+    return ready;
+}
+
+// Next datagram from any path, -1 after timeout_ms (-1 waits forever).
+// Datagrams that don't come from the path's peer are dropped.
+static ssize_t paths_recv_raw(PathSet *paths, void *buf, size_t len, int timeout_ms, Path **from) {
+    int waited = 0;
+
+    while (1) {
+        for (int k = 0; k < paths->count; ++k) {
+            int i = (paths->next_recv + k) % paths->count;
+            Path *path = &paths->paths[i];
+            struct sockaddr_storage addr;
+            socklen_t addr_len;
+            ssize_t n;
+            do {
+                addr_len = sizeof(addr);
+                n = recvfrom(path->sockfd, buf, len, MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+            } while (n >= 0 && !sockaddr_equal(&addr, &path->dest_addr));
+            if (n >= 0) {
+                paths->next_recv = i + 1;
+                if (timeout_ms != 0 && !waited) paths->polled++; // there already, drains don't count
+                path->received_packets++;
+                path->received_bytes += n;
+                if (from) *from = path;
+                return n;
+            }
         }
-        sleep(1);
+        if (timeout_ms == 0) return -1;
+
+        waited = 1;
+        if (paths_wait(paths, -1, timeout_ms, NULL) <= 0) return -1;
     }
+}
 
-    if (pstate.state == 0) {
-        pstate.state = -1; // Timeout
-        fprintf(stderr, "Failed to punch hole after 10 seconds.\n");
-        pthread_cancel(thread); // Kill listening thread on timeout
+ssize_t paths_recv(PathSet *paths, void *buf, size_t len, int timeout_ms, Path **from) {
+    if (!paths->aead) return paths_recv_raw(paths, buf, len, timeout_ms, from);
+
+    PacketQueue *queue = paths->recv_queue;
+    while (1) {
+        while (queue->next < queue->count) {
+            int i = queue->next++;
+            AeadPacket *packet = &queue->packets[i];
+            if (!packet->ok) continue;
+            size_t n = packet->len < len ? packet->len : len;
+            memcpy(buf, packet->data, n);
+            if (from) *from = queue->paths[i];
+            return n;
+        }
+
+        // Wait for one datagram, then take whatever else is already there
+        queue->count = queue->next = 0;
+        ssize_t n = paths_recv_raw(paths, queue->packets[0].data, QUEUE_SLOT, timeout_ms, &queue->paths[0]);
+        if (n < 0) return -1;
+        do {
+            queue->packets[queue->count++].len = n;
+        } while (queue->count < AEAD_BATCH &&
+                 (n = paths_recv_raw(paths, queue->packets[queue->count].data, QUEUE_SLOT, 0, &queue->paths[queue->count])) >= 0);
+        aead_open_batch(paths->aead, queue->packets, queue->count);
+    }
+}
+
+// Receiver: tell the sender what arrived on each path, at most every PATH_REPORT_MS
+void paths_send_reports(PathSet *paths) {
+    uint64_t now = get_timestamp_millis();
+    if (now - paths->last_report < PATH_REPORT_MS) return;
+    paths->last_report = now;
+
+    for (int i = 0; i < paths->count; ++i) {
+        Path *path = &paths->paths[i];
+        PathReportPacket report;
+        report.received_packets = path->received_packets;
+        report.received_bytes = path->received_bytes;
+        uint8_t packet[32];
+        size_t len = wire_put_path_report(packet, &report);
+        path_send_packet(paths, path, packet, len);
+    }
+}
+
+// Sender: update a path's loss, capacity, weight and chunk size from the receiver's report
+void paths_handle_report(PathSet *paths, Path *path, const void *packet, size_t len) {
+    PathReportPacket decoded;
+    const PathReportPacket *report = &decoded;
+    if (wire_get_path_report(packet, len, &decoded) < 0) return;
+    if (report->received_packets < path->report_received_packets) return; // reordered
+
+    uint64_t now = get_timestamp_millis();
+    uint64_t sent = path->sent_packets - path->report_sent_packets;
+    uint64_t received = report->received_packets - path->report_received_packets;
+    uint64_t received_bytes = report->received_bytes - path->report_received_bytes;
+
+    if (path->report_t && now > path->report_t) {
+        if (sent > 0) {
+            double loss = received >= sent ? 0 : 1.0 - (double)received / sent;
+            path->loss = PATH_EWMA * loss + (1 - PATH_EWMA) * path->loss;
+        }
+        double rate = 1000.0 * received_bytes / (now - path->report_t);
+        path->capacity = path->capacity ? PATH_EWMA * rate + (1 - PATH_EWMA) * path->capacity : rate;
+
+        int probing = path == &paths->paths[paths->probing % paths->count];
+        double weight = path->capacity * (path->loss < PATH_LOSS_LOW ? 1 : 1 - path->loss);
+        if (probing && path->loss < PATH_LOSS_LOW) {
+            double total = 0;
+            for (int i = 0; i < paths->count; ++i) total += paths->paths[i].capacity;
+            weight += PATH_PROBE_GAIN * total / paths->count;
+        }
+        if (probing) paths->probing = (paths->probing + 1) % paths->count; // next path's turn
+        path->weight = weight > PATH_MIN_RATE ? weight : PATH_MIN_RATE;
+
+        // Per datagram: IP/UDP and chunk headers, plus its share of the control traffic coming back
+        if (path->tune_chunk && sent > 0) {
+            double overhead = path->ip_header
+                + (double)(path->sent_header_bytes - path->report_sent_header_bytes) / sent
+                + (double)(path->received_bytes - path->report_control_bytes) / sent;
+            path->chunk_size = tune_chunk_size(path->chunk_size, path->loss, path->mtu_payload, overhead, CHUNK_MAX);
+        }
     }
 
-    pthread_join(thread, NULL); // Clean up thread
-    return pstate.state;
+    path->report_t = now;
+    path->report_sent_header_bytes = path->sent_header_bytes;
+    path->report_control_bytes = path->received_bytes;
+    path->report_sent_packets = path->sent_packets;
+    path->report_received_packets = report->received_packets;
+    path->report_received_bytes = report->received_bytes;
 }
 
 
 void *periodic_sender_routine(void *arg) {
     periodic_sender_context_t *data = (periodic_sender_context_t *)arg;
     while (1) {
-        sendto(data->sockfd, data->data, data->datalen, 0,
-               data->addr, data->addr_len);
+        // One copy per round, else the receiver answers every path with the same NACK
+        path_send_packet(data->paths, paths_best(data->paths), data->data, data->datalen);
         sleep(1);  // Send every 1 second
     }
     free(data);
     return NULL;
 }
 
+// Startup latency: connection setup until the first data went out or came in, recorded once
+void netstats_first_data(NetStats *netStats) {
+    if (netStats->first_data) return;
+    netStats->first_data = 1;
+    netStats->startup_ms = get_timestamp_millis() - netStats->setup_t;
+    printf("Startup: %lu ms to first data\n", netStats->startup_ms);
+}
+
 void *netstats_routine(void *arg) {
     NetStats * netStats = (NetStats *) arg;
+    if (netStats->stats_cpu >= 0) pin_thread(netStats->stats_cpu);
 
     int i = 0;
     while(1){
@@ -171,13 +924,41 @@ void *netstats_routine(void *arg) {
         double percentage = (double) netStats->total_bytes_transfered / (double) netStats->file_size;
         
         // print only once a second
-        if( i%10 == 0 ){
+        if( i%10 == 0 && netStats->file_size == 0 ){
+            // Streaming, total size unknown
+            char total_unit[3];
+            double conv_total = format_size_with_unit(netStats->total_bytes_transfered, total_unit);
+            if(netStats->role == SENDER) {
+                printf("sent: %.1f %s | bitrate: %.1f %s/s | sleep_delay %ld | chunk: %u\n", conv_total, total_unit, conv_bitrate, unit, netStats->sleep_delay, netStats->paths->paths[0].chunk_size);
+            } else if (netStats->role == RECEIVER){
+                printf("received: %.1f %s | bitrate: %.1f %s/s\n", conv_total, total_unit, conv_bitrate, unit);
+            }
+        } else if( i%10 == 0 ){
             if(netStats->role == SENDER) {
-                printf("sent: %.2f | bitrate: %.1f %s/s | sleep_delay %ld\n", percentage, conv_bitrate, unit, netStats->sleep_delay);
+                printf("sent: %.2f | bitrate: %.1f %s/s | sleep_delay %ld | chunk: %u\n", percentage, conv_bitrate, unit, netStats->sleep_delay, netStats->paths->paths[0].chunk_size);
             } else if (netStats->role == RECEIVER){
                 printf("received: %.2f | bitrate: %.1f %s/s\n", percentage, conv_bitrate, unit);
             }
         }
+
+        // Share of receives that didn't have to sleep, to see whether busy polling pays off
+        if( i%10 == 0 && netStats->paths && netStats->paths->low_latency ){
+            uint64_t polled = netStats->paths->polled - netStats->last_polled;
+            uint64_t slept = netStats->paths->slept - netStats->last_slept;
+            netStats->last_polled += polled;
+            netStats->last_slept += slept;
+            printf("  polled: %lu | slept: %lu | polled ratio: %.1f%%\n", polled, slept, polled + slept ? 100.0 * polled / (polled + slept) : 0);
+        }
+
+        if( i%10 == 0 && netStats->role == SENDER && netStats->paths && netStats->paths->count > 1 ){
+            for (int p = 0; p < netStats->paths->count; ++p) {
+                Path *path = &netStats->paths->paths[p];
+                char addr[INET6_ADDRSTRLEN + 8];
+                format_address(&path->dest_addr, addr, sizeof(addr));
+                double conv_capacity = format_size_with_unit(path->capacity, unit);
+                printf("  path %d %s | loss: %.2f%% | delivered: %.1f %s/s | chunk: %u\n", p, addr, 100 * path->loss, conv_capacity, unit, path->chunk_size);
+            }
+        }
         
         netStats->t1 = t2;
         netStats->delta_bytes_transfered = 0;
@@ -193,13 +974,14 @@ void *slowdown_routine(void *arg) {
         uint8_t buffer[1024];
         ssize_t bytes_received = recvfrom(netStats->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&netStats->dest_addr, &netStats->dest_addr_len);
         if (bytes_received > 0) {
-            SlowdownPacket *slowdownPacket = (SlowdownPacket *) buffer;
+            uint64_t bitrate;
+            if (wire_get_slowdown(buffer, bytes_received, &bitrate) < 0) continue;
 
             float threshold = 0.95;
             float factor = 1.1;
-            if(slowdownPacket->bitrate < threshold*netStats->current_bitrate){
+            if(bitrate < threshold*netStats->current_bitrate){
                 netStats->sleep_delay *= factor;
-            } else if (slowdownPacket->bitrate > threshold*netStats->current_bitrate){
+            } else if (bitrate > threshold*netStats->current_bitrate){
                 netStats->sleep_delay /= factor;
             }
         }
@@ -1,13 +1,69 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include "packets.h"
+#include "crypto.h"
+
+#define MAX_PATHS 8
 
 enum net_stats_role {
   SENDER,
   RECEIVER
 };
 
+// One local socket talking to one remote address
+typedef struct {
+    int sockfd;
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage dest_addr;
+    socklen_t dest_addr_len;
+
+    // Sender side scheduling, fed by the receiver's PATH_REPORTs
+    double weight;   // share of new chunks
+    double credit;   // smooth weighted round robin
+    double loss;     // smoothed loss rate
+    double capacity; // smoothed delivered bytes/s
+    uint64_t sent_packets;
+    uint64_t sent_bytes;
+    uint64_t report_t;
+    uint64_t report_sent_packets;
+    uint64_t report_received_packets;
+    uint64_t report_received_bytes;
+
+    // Sender side chunk sizing
+    uint32_t chunk_size;  // data bytes per chunk on this path
+    uint32_t mtu_payload; // largest chunk that isn't fragmented
+    uint32_t ip_header;   // IP + UDP header bytes
+    int tune_chunk;       // retune chunk_size on every report
+    uint64_t sent_header_bytes;
+    uint64_t report_sent_header_bytes;
+    uint64_t report_control_bytes;
+
+    // Receiver side counters, sent back in PATH_REPORTs
+    uint64_t received_packets;
+    uint64_t received_bytes;
+} Path;
+
+typedef struct {
+    int count;
+    int next_recv;        // round robin start for paths_recv
+    uint64_t last_report; // receiver: last PATH_REPORT round
+    int probing;          // sender: path that gets headroom this report round
+    int pending;          // sender: unconfirmed paths after the active ones, still being probed
+    int low_latency;      // --low-latency: busy polling, NUMA-local buffers
+    uint64_t polled;      // waits that found data without sleeping
+    uint64_t slept;       // waits that had to sleep in poll()
+    Aead *aead;           // --psk-file: sealed datagrams, NULL in the clear
+    struct PacketQueue *send_queue; // chunks waiting to be sealed as a batch
+    struct PacketQueue *recv_queue; // datagrams opened as a batch, not handed out yet
+    Path paths[MAX_PATHS];
+} PathSet;
+
 typedef struct {
     uint8_t role; // 0 = sender, 1 = receiver
     uint64_t file_size;
@@ -15,26 +71,63 @@ typedef struct {
     uint64_t delta_bytes_transfered; // since t1
     uint64_t t1;
     int sockfd;
-    struct sockaddr_in dest_addr;
+    struct sockaddr_storage dest_addr;
     socklen_t dest_addr_len;
     uint64_t sleep_delay;
     uint64_t current_bitrate;
+    PathSet *paths;
+    uint64_t setup_t;     // when connection setup started
+    uint64_t startup_ms;  // from setup_t to the first data sent or received
+    int first_data;
+    int stats_cpu;        // core the stats thread runs on, -1 for any
+    uint64_t last_polled;
+    uint64_t last_slept;
 } NetStats;
 
 typedef struct {
-    int sockfd;
-    struct sockaddr *addr;
-    socklen_t addr_len;
+    PathSet *paths; // sent on the best path
     uint8_t * data;
     int datalen;
     volatile int *state;
 } periodic_sender_context_t;
 
-int create_and_bind_udp_socket(struct sockaddr_in *local_addr);
+int create_and_bind_udp_socket(struct sockaddr_storage *local_addr);
+
+void get_paths(PathSet *paths, int argc, char *argv[], int can_prompt);
+
+void set_low_latency(PathSet *paths, NetStats *netStats, int argc, char *argv[]);
+
+void paths_set_aead(PathSet *paths, Aead *aead);
+
+void paths_connect(PathSet *paths, const uint8_t *init, size_t init_len);
+
+void paths_accept(PathSet *paths, InitPacket *init);
+
+int path_ack_init(PathSet *paths, Path *path, const uint8_t *init, size_t init_len);
+
+void netstats_first_data(NetStats *netStats);
+
+void paths_setup_chunks(PathSet *paths, uint32_t mtu, uint32_t chunk_size);
+
+Path *paths_pick(PathSet *paths);
+
+Path *paths_best(PathSet *paths);
+
+ssize_t paths_send(PathSet *paths, Path *path, const struct iovec *iov, int iovcnt);
+
+void paths_flush(PathSet *paths);
+
+ssize_t path_send_packet(PathSet *paths, Path *path, const uint8_t *packet, size_t len);
+
+int paths_wait(PathSet *paths, int extra_fd, int timeout_ms, int *extra_ready);
+
+ssize_t paths_recv(PathSet *paths, void *buf, size_t len, int timeout_ms, Path **from);
+
+void paths_send_reports(PathSet *paths);
 
-void get_destination(struct sockaddr_in *dest_addr, int argc, char *argv[]);
+void paths_handle_report(PathSet *paths, Path *path, const void *packet, size_t len);
 
-int udp_hole_punch(int sockfd, struct sockaddr_in *dest_addr);
+void format_address(const struct sockaddr_storage *addr, char *buf, size_t len);
 
 void *periodic_sender_routine(void *arg);
 
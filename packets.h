@@ -1,39 +1,54 @@
+#ifndef PACKETS_H
+#define PACKETS_H
+
 #include <stdint.h>
 
-#define MAX_NACK 350 // 4 byte per seq, NackPacket about 1408 bytes
+// Packets are (de)serialized by wire.c, these are their decoded forms.
+// Bump WIRE_VERSION whenever the encoding changes.
+#define WIRE_VERSION 5
 
 typedef enum {
     INIT,
     FILE_CHUNK,
     CHECK,
     NACK,
-    SLOWDOWN
+    SLOWDOWN,
+    ACK,
+    PATH_REPORT,
+    LAST_CHUNK, // a FILE_CHUNK that ends a stream
+    PUNCH       // receiver's hole punching probe
 } PacketType;
 
-typedef struct {
-    PacketType type;
-} Packet;
+/*
 
-typedef struct {
-    PacketType type;
-    uint32_t seq_num;
-    uint32_t data_len;
-    // Data follows
-} ChunkPacketHeader;
+Sequence numbers count units of unit_size bytes from the start of the
+file or stream. A chunk is any whole number of units (the sender tunes
+its size as it goes), only the file's or stream's last chunk may end in
+a partial unit. A stream always ends with a LAST_CHUNK, an empty one
+still takes up a unit of sequence space.
+
+*/
 
 typedef struct {
-    PacketType type;
     uint64_t file_size;
-    uint32_t frame_size;
+    uint32_t unit_size;
+    uint32_t max_chunk; // largest chunk data the receiver has to expect
+    uint32_t window;    // streaming window in bytes, 0 for a regular file
+    uint32_t flags;     // INIT_* bits
 } InitPacket;
 
+#define INIT_AEAD 1 // everything after the handshake is sealed, see crypto.c
+
+// Units start .. start + count - 1, listed in NACKs and ACKs
 typedef struct {
-    PacketType type;
+    uint64_t start;
     uint32_t count;
-    uint32_t missing[MAX_NACK];
-} NackPacket;
+} SeqRange;
 
+// Receiver -> sender on each path, totals received on that path so far
 typedef struct {
-    PacketType type;
-    uint64_t bitrate;
-} SlowdownPacket;
\ No newline at end of file
+    uint64_t received_packets;
+    uint64_t received_bytes;
+} PathReportPacket;
+
+#endif // PACKETS_H
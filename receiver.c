@@ -13,175 +13,272 @@
 #include "network.h"
 #include "utils.h"
 #include "packets.h"
+#include "wire.h"
+
+#define NACK_BURST 10     // NACK packets sent per CHECK at most
+#define NACK_LINGER_MS 1500 // keep confirming completion while the sender still CHECKs
+
+// Received units are kept as one bit each. First unit in [from, to) whose bit is `value`, to if there's none. Skips whole words at a time.
+static uint64_t find_unit(const uint64_t *received, uint64_t from, uint64_t to, int value) {
+    while (from < to) {
+        uint64_t word = value ? received[from / 64] : ~received[from / 64];
+        word &= ~0ULL << (from % 64);
+        if (word) {
+            uint64_t found = from / 64 * 64 + __builtin_ctzll(word);
+            return found < to ? found : to;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+// Missing units in [from, to) as ranges, at most max of them. *next is where the scan stopped.
+size_t collect_missing(const uint64_t *received, uint64_t from, uint64_t to, SeqRange *ranges, size_t max, uint64_t *next) {
+    size_t count = 0;
+    uint64_t i = from;
+    while (count < max && (i = find_unit(received, i, to, 0)) < to) {
+        uint64_t start = i;
+        uint64_t limit = to - start > UINT32_MAX ? start + UINT32_MAX : to;
+        i = find_unit(received, start, limit, 1);
+        ranges[count].start = start;
+        ranges[count].count = i - start;
+        count++;
+    }
+    *next = i;
+    return count;
+}
+
+/*
+
+Validates a FILE_CHUNK datagram and writes its data at its offset unless
+every unit of it was received already. Returns the bytes written, 0 for
+a duplicate and -1 for an invalid chunk.
+
+*/
+ssize_t receive_file_chunk(FILE *fp, uint64_t *received_units, uint64_t file_size, uint32_t unit, uint32_t max_chunk, const uint8_t *packet, size_t len) {
+    uint64_t seq_num;
+    int header_len = wire_get_chunk_header(packet, len, &seq_num);
+    if (header_len < 0) return -1;
+
+    // Check if the sequence number is valid
+    if (seq_num >= (file_size + unit - 1) / unit) {
+        fprintf(stderr, "Received out-of-range packet %lu\n", seq_num);
+        return -1;
+    }
+
+    // Validate the packet data length: whole units, only the file's tail may be short
+    size_t data_len = len - header_len;
+    uint64_t offset = seq_num * unit;
+    if (data_len == 0 || data_len > max_chunk || data_len > file_size - offset
+        || (data_len % unit && offset + data_len != file_size)) {
+        fprintf(stderr, "Invalid packet size or corrupted data\n");
+        return -1;
+    }
+
+    // Process only if some of it hasn't been received yet
+    uint64_t end = seq_num + (data_len + unit - 1) / unit;
+    if (find_unit(received_units, seq_num, end, 0) == end) return 0;
+
+    // Write data directly to file at the correct offset
+    fseek(fp, offset, SEEK_SET);
+    fwrite(packet + header_len, 1, data_len, fp);
+    fflush(fp);
+
+    for (uint64_t i = seq_num; i < end; i++) received_units[i / 64] |= 1ULL << (i % 64);
+    return data_len;
+}
+
+static const char *get_output_path(int argc, char *argv[]) {
+    const char *path = "received_file";
+
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        }
+    }
+    return path;
+}
 
 void receiver_run(int argc, char *argv[]) {
 
-    struct sockaddr_in local_addr;
-    int sockfd = create_and_bind_udp_socket(&local_addr);
+    // Keep stdout for the data, everything we print goes to stderr
+    const char *output_path = get_output_path(argc, argv);
+    int to_stdout = strcmp(output_path, "-") == 0;
+    int out_fd = -1;
+    if (to_stdout) {
+        out_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    PathSet paths;
+    get_paths(&paths, argc, argv, 1);
 
     NetStats netStats;
     netStats.role = 1;
     netStats.total_bytes_transfered = 0;
     netStats.delta_bytes_transfered = 0;
     netStats.t1 = 0;
+    netStats.paths = &paths;
+    netStats.first_data = 0;
+    netStats.startup_ms = 0;
+    set_low_latency(&paths, &netStats, argc, argv);
 
-    struct sockaddr_in sender_addr;
-    get_destination(&sender_addr, argc, argv);
+    // Punch the paths until the sender's INIT comes through
+    InitPacket initPacket;
+    paths_set_aead(&paths, get_aead(argc, argv, 0));
+    netStats.setup_t = get_timestamp_millis();
+    paths_accept(&paths, &initPacket);
 
-    // only required for receiver, no ack, just 3 outgoing udp
-    if(udp_hole_punch(sockfd, &sender_addr) == -1){
+    uint64_t file_size = initPacket.file_size;
+    netStats.file_size = file_size;
+    uint32_t unit = initPacket.unit_size;
+    uint32_t max_chunk = initPacket.max_chunk;
+    uint32_t window = initPacket.window;
+
+    if (window) {
+        printf("Receiving stream, chunks up to: %u, window: %u bytes\n", max_chunk, window);
+        if (!to_stdout) {
+            out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd < 0) {
+                perror_exit("Failed to open file for writing");
+            }
+        }
+    } else if (to_stdout) {
+        fprintf(stderr, "Writing to stdout requires a streaming sender\n");
         exit(EXIT_FAILURE);
+    } else {
+        printf("Receiving file size: %lu, chunks up to: %u\n", file_size, max_chunk);
     }
 
-    // Receive file metadata
-    InitPacket initPacket;
-    while(1){
-        ssize_t n = recvfrom(sockfd, &initPacket, sizeof(initPacket), 0, NULL, NULL);
-        if(initPacket.type == INIT && n == sizeof(initPacket)) break;
+    if (window) {
+        pthread_t netstats_thread;
+        start_thread(&netstats_thread, netstats_routine, &netStats);
+        pthread_detach(netstats_thread);
+
+        stream_receive(&paths, out_fd, unit, max_chunk, window, &netStats);
+
+        pthread_cancel(netstats_thread);
+        close(out_fd);
+        for (int i = 0; i < paths.count; ++i) close(paths.paths[i].sockfd);
+        return;
     }
-    
-    uint64_t file_size = initPacket.file_size;
-    netStats.file_size = file_size;
-    uint32_t frame_size = initPacket.frame_size;
-    printf("Receiving file size: %lu, frame size: %u\n", file_size, frame_size);
 
 
     // Open file for writing
-    FILE *fp = fopen("received_file", "wb");
+    FILE *fp = fopen(output_path, "wb");
     if (!fp) {
         fprintf(stderr, "Failed to open file for writing\n");
         exit(EXIT_FAILURE);
     }
 
     // Pre-allocate file size
-    fseek(fp, file_size - 1, SEEK_SET);
-    fputc('\0', fp);
-    fflush(fp);
+    if (file_size > 0) {
+        fseek(fp, file_size - 1, SEEK_SET);
+        fputc('\0', fp);
+        fflush(fp);
+    }
 
     // Initialize tracking variables
-    uint32_t last_nack_index = 0;
-    uint64_t total_packets = (file_size + frame_size - 1) / frame_size;
-    uint8_t *received_packets = calloc(total_packets, sizeof(uint8_t));
-    if (!received_packets) {
+    uint64_t last_nack_index = 0;
+    uint64_t total_units = (file_size + unit - 1) / unit;
+    size_t bitmap_size = (total_units + 63) / 64 * sizeof(uint64_t);
+    uint64_t *received_units = buffer_alloc(bitmap_size, paths.low_latency);
+    if (!received_units) {
         perror_exit("Failed to allocate memory for received packets");
     }
 
-    uint8_t *buffer = malloc(frame_size + sizeof(ChunkPacketHeader));
-    if (!buffer) {
+    uint8_t *buffer = buffer_alloc(max_chunk + WIRE_CHUNK_HEADER_MAX, paths.low_latency);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+    if (!buffer || !missing) {
         perror_exit("Failed to allocate buffer");
     }
 
 
-    Packet initAckPacket;
-    initAckPacket.type=INIT;
-
-    // Send periodically the init ack packet ( 'pls start' packet )
-    pthread_t periodic_sender_thread;
-    pthread_create(&periodic_sender_thread, NULL, periodic_sender_routine, &(periodic_sender_context_t){
-        .sockfd = sockfd,
-        .addr = (struct sockaddr*)&sender_addr,
-        .addr_len = sizeof(sender_addr),
-        .data = (uint8_t*)&initAckPacket,
-        .datalen = sizeof(initAckPacket)
-    });
-    pthread_detach(periodic_sender_thread);
-
     // Start network stats routine
     pthread_t netstats_thread;
-    pthread_create(&netstats_thread, NULL, netstats_routine, &netStats);
+    start_thread(&netstats_thread, netstats_routine, &netStats);
     pthread_detach(netstats_thread);
 
 
-    // Start slowdown packet listenner 
-    pthread_t slowdown_thread;
-    pthread_create(&slowdown_thread, NULL, slowdown_routine, &netStats);
-    pthread_detach(slowdown_thread);
-
-
 
     int complete = 0;
+    Path *from;
     while (!complete) {
 
         // Listen for file chunks or check packets
-        ssize_t n = recvfrom(sockfd, buffer, frame_size+sizeof(ChunkPacketHeader), 0, NULL, NULL);
-        if (n < sizeof(Packet)) {
+        ssize_t n = paths_recv(&paths, buffer, max_chunk+WIRE_CHUNK_HEADER_MAX, -1, &from);
+        paths_send_reports(&paths);
+        int type = wire_get_type(buffer, n > 0 ? n : 0);
+        if (type < 0) {
             fprintf(stderr, "Received an incomplete packet\n");
             continue;
         }
 
-        Packet * packet = (Packet *) buffer;
-
-        if(packet->type == FILE_CHUNK && n >= sizeof(ChunkPacketHeader)){
-            if (periodic_sender_thread) {
-                pthread_cancel(periodic_sender_thread);
-                periodic_sender_thread = 0;
-            }
-
-            ChunkPacketHeader *header = (ChunkPacketHeader *) buffer;
-
-            // Validate the packet data length
-            if (header->data_len > frame_size || n < sizeof(ChunkPacketHeader) + header->data_len) {
-                fprintf(stderr, "Invalid packet size or corrupted data\n");
-                continue;
-            }
-
-            // Check if the sequence number is valid
-            if (header->seq_num >= total_packets) {
-                fprintf(stderr, "Received out-of-range packet %u\n", header->seq_num);
-                continue;
-            }
-
-            // Process only if the packet hasn't been received yet
-            if (!received_packets[header->seq_num]) {
-                netStats.delta_bytes_transfered += header->data_len;
-                
-                uint64_t offset = (uint64_t)header->seq_num * frame_size;
-
-                // Write data directly to file at the correct offset
-                fseek(fp, offset, SEEK_SET);
-                fwrite(buffer + sizeof(ChunkPacketHeader), 1, header->data_len, fp);
-                fflush(fp);
-
-                received_packets[header->seq_num] = 1;
+        if(type == FILE_CHUNK){
+            netstats_first_data(&netStats);
+            ssize_t written = receive_file_chunk(fp, received_units, file_size, unit, max_chunk, buffer, n);
+            if (written > 0) {
+                netStats.delta_bytes_transfered += written;
             }
 
-        } else if(packet->type == CHECK) { // SEND NACK
-            
-             uint32_t requested_total = 0;
-            uint32_t stop_nack_index = (last_nack_index+total_packets-1)%total_packets;
-            for (size_t j = 0; j < 10; j++) { //todo optimize 10
-                uint32_t missing_count = 0;
-                uint32_t missing_packets[MAX_NACK];
-                for (uint32_t i = last_nack_index; i < total_packets+last_nack_index; i++) {
-                    if (!received_packets[i%total_packets]) {
-                        missing_packets[missing_count++] = i%total_packets;
-
-                        if (missing_count == MAX_NACK || i == stop_nack_index) {
-                            last_nack_index = (i+1)%total_packets;
-                            break;
-                        }
-                    }
+        } else if(type == INIT) {
+            path_ack_init(&paths, from, buffer, n); // our ack got lost, or this path wasn't confirmed yet
+
+        } else if(type == CHECK) { // SEND NACK
+
+            // Missing chunks from where the last round stopped to the end, then from the start
+            uint32_t requested_total = 0;
+            uint64_t scan_from = last_nack_index, scan_to = total_units;
+            int wrapped = last_nack_index == 0;
+            int sent = 0;
+            while (sent < NACK_BURST) {
+                uint64_t next;
+                size_t count = collect_missing(received_units, scan_from, scan_to, missing, WIRE_MAX_RANGES, &next);
+                size_t done = 0;
+                while (done < count && sent < NACK_BURST) {
+                    size_t used = send_nack(&paths, from, NACK, 0, 0, missing + done, count - done);
+                    for (size_t i = done; i < done + used; i++) requested_total += missing[i].count;
+                    done += used;
+                    sent++;
                 }
-
-                if (missing_count == 0) {
-                    complete = 1;
+                if (done < count) {
+                    last_nack_index = missing[done].start;
                     break;
                 }
-
-                requested_total+=missing_count;
-                send_nack(sockfd, &sender_addr, missing_packets, missing_count);
-                if(stop_nack_index+1 == last_nack_index){
+                scan_from = next;
+                if (sent == NACK_BURST) {
+                    last_nack_index = scan_from < total_units ? scan_from : 0;
                     break;
                 }
+                if (scan_from >= scan_to) {
+                    if (wrapped) break;
+                    wrapped = 1;
+                    scan_from = 0;
+                    scan_to = last_nack_index;
+                }
+            }
+
+            if (requested_total == 0) {
+                send_nack(&paths, from, NACK, 0, 0, NULL, 0); // nothing missing, we're done
+                complete = 1;
+            } else {
+                printf("Requested %i missing packet.\n",requested_total);
             }
-            printf("Requested %i missing packet.\n",requested_total);
         }
     }
 
-    printf("File transfer complete!\n");
+    // The sender CHECKs again if that empty NACK got lost
+    ssize_t n;
+    while ((n = paths_recv(&paths, buffer, max_chunk+WIRE_CHUNK_HEADER_MAX, NACK_LINGER_MS, &from)) >= 0) {
+        if (wire_get_type(buffer, n) == CHECK) send_nack(&paths, from, NACK, 0, 0, NULL, 0);
+    }
+
+    printf("File transfer complete! Startup: %lu ms to first data\n", netStats.startup_ms);
+    if (paths.aead) printf("Rejected %lu packets that failed authentication\n", aead_rejected(paths.aead));
     pthread_cancel(netstats_thread);
-    free(buffer);
-    free(received_packets);
+    buffer_free(buffer, max_chunk + WIRE_CHUNK_HEADER_MAX, paths.low_latency);
+    buffer_free(received_units, bitmap_size, paths.low_latency);
+    free(missing);
     fclose(fp);
-    close(sockfd);
+    for (int i = 0; i < paths.count; ++i) close(paths.paths[i].sockfd);
 }
\ No newline at end of file
@@ -13,128 +13,194 @@
 #include "network.h"
 #include "utils.h"
 #include "packets.h"
+#include "wire.h"
+#include "tune.h"
 
 #define UDP_PAYLOAD_SIZE 1400 // Optimized. Max UDP payload size (65,507 bytes)
+#define DEFAULT_STREAM_WINDOW (8u << 20) // bytes kept for retransmission when streaming
 
 
+static uint32_t get_option(int argc, char *argv[], const char *name, uint32_t value) {
+    for (int i = 0; i < argc; ++i) {
+        if (strcmp(argv[i], name) == 0 && i + 1 < argc) {
+            value = strtoul(argv[++i], NULL, 10);
+        }
+    }
+    return value;
+}
+
+static uint32_t get_stream_window(int argc, char *argv[], uint32_t max_chunk) {
+    uint32_t window = get_option(argc, argv, "--window", DEFAULT_STREAM_WINDOW) / CHUNK_UNIT * CHUNK_UNIT;
+
+    if (window < max_chunk || window > (1u << 30)) {
+        fprintf(stderr, "Invalid window size, it takes at least %u bytes\n", max_chunk);
+        exit(EXIT_FAILURE);
+    }
+    return window;
+}
+
+// 0 lets the sender tune it
+static uint32_t get_chunk_size(int argc, char *argv[]) {
+    uint32_t chunk_size = get_option(argc, argv, "--chunk-size", 0);
+
+    if (chunk_size % CHUNK_UNIT || chunk_size > CHUNK_MAX) {
+        fprintf(stderr, "Invalid chunk size, it must be a multiple of %u up to %u\n", CHUNK_UNIT, CHUNK_MAX);
+        exit(EXIT_FAILURE);
+    }
+    return chunk_size;
+}
+
 // Sender implementation
 void sender_run(const char *file_path, int argc, char *argv[]) {
-    struct sockaddr_in local_addr;
-    int sockfd = create_and_bind_udp_socket(&local_addr);
-
-    struct sockaddr_in dest_addr;
-    get_destination(&dest_addr, argc, argv);
-    socklen_t dest_addr_len = sizeof(dest_addr);
+    PathSet paths;
+    get_paths(&paths, argc, argv, strcmp(file_path, "-") != 0); // "-" streams stdin, no prompting on it
 
     NetStats netStats;
     netStats.role = 0;
     netStats.total_bytes_transfered = 0;
     netStats.delta_bytes_transfered = 0;
     netStats.t1 = 0;
-    netStats.sockfd = sockfd;
-    netStats.dest_addr = dest_addr;
-    netStats.dest_addr_len = dest_addr_len;
+    netStats.sockfd = paths.paths[0].sockfd;
+    netStats.dest_addr = paths.paths[0].dest_addr;
+    netStats.dest_addr_len = paths.paths[0].dest_addr_len;
     netStats.sleep_delay = 0;
+    netStats.paths = &paths;
+    netStats.first_data = 0;
+    netStats.startup_ms = 0;
+    set_low_latency(&paths, &netStats, argc, argv);
+    paths_set_aead(&paths, get_aead(argc, argv, 1));
 
-    if(udp_hole_punch(sockfd, &dest_addr) == -1){
-        exit(EXIT_FAILURE);
-    }
+    // Chunks start out as big as the path MTU allows, then follow the measured loss
+    uint32_t chunk_size = get_chunk_size(argc, argv);
+    uint32_t max_chunk = chunk_size ? chunk_size : CHUNK_MAX;
+    paths_setup_chunks(&paths, get_option(argc, argv, "--mtu", 0), chunk_size);
 
-    int frame_size = 1420 - sizeof(ChunkPacketHeader);
+    // "-" streams stdin, its size is unknown so only a window of it is kept around
+    int streaming = strcmp(file_path, "-") == 0;
+    uint32_t window = streaming ? get_stream_window(argc, argv, max_chunk) : 0;
 
     // Open the file
-    FILE *fp = fopen(file_path, "rb");
+    FILE *fp = streaming ? stdin : fopen(file_path, "rb");
     if (!fp) {
         perror_exit("Failed to open file");
     }
 
     // Get file size
-    fseek(fp, 0, SEEK_END);
-    uint64_t file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    printf("File size:%lu\n", file_size);
+    uint64_t file_size = 0;
+    if (streaming) {
+        printf("Streaming from stdin, window: %u bytes\n", window);
+    } else {
+        fseek(fp, 0, SEEK_END);
+        file_size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        printf("File size:%lu\n", file_size);
+    }
     netStats.file_size = file_size;
 
 
     // Send file metadata
     InitPacket initPacket;
-    initPacket.type = INIT;
     initPacket.file_size = file_size;
-    initPacket.frame_size = frame_size;
-
-    // Send periodically the init packet
-    pthread_t periodic_sender_thread;
-    pthread_create(&periodic_sender_thread, NULL, periodic_sender_routine, &(periodic_sender_context_t){
-        .sockfd = sockfd,
-        .addr = (struct sockaddr*)&dest_addr,
-        .addr_len = sizeof(dest_addr),
-        .data = (uint8_t*)&initPacket,
-        .datalen = sizeof(initPacket)
-    });
-    pthread_detach(periodic_sender_thread);
-
-    // Wait for the receiver to ack
-    Packet initAckPacket;
-    while(1) {
-        ssize_t bytes_received = recvfrom(sockfd, &initAckPacket, sizeof(initAckPacket), 0, (struct sockaddr *)&dest_addr, &dest_addr_len);
-        if (bytes_received > 0) {
-            if (initAckPacket.type == INIT) {
-                printf("Starting transmission...\n");
-                pthread_cancel(periodic_sender_thread);
-                break;
-            }
-        }
-    }
+    initPacket.unit_size = CHUNK_UNIT;
+    initPacket.max_chunk = max_chunk;
+    initPacket.window = window;
+    initPacket.flags = paths.aead ? INIT_AEAD : 0;
+    uint8_t init[WIRE_MAX_PACKET];
+    size_t init_len = wire_put_init(init, &initPacket);
+    if (paths.aead) init_len = aead_put_init_auth(paths.aead, init, init_len);
+
+    // Punch the paths with the INIT itself, data goes out as soon as it's acked
+    netStats.setup_t = get_timestamp_millis();
+    paths_connect(&paths, init, init_len);
+    printf("Starting transmission...\n");
 
     // Start network stats routine
     pthread_t netstats_thread;
-    pthread_create(&netstats_thread, NULL, netstats_routine, &netStats);
+    start_thread(&netstats_thread, netstats_routine, &netStats);
     pthread_detach(netstats_thread);
 
-    // Send file data
-    uint32_t seq_num = 0;
-    size_t bytes_read;
-    uint8_t *buffer = malloc(frame_size + sizeof(ChunkPacketHeader));
-    while ((bytes_read = send_file_chunk(sockfd, &dest_addr, dest_addr_len, fp, seq_num, frame_size, buffer, &netStats)) == 0) {
-        seq_num++;
+    if (streaming) {
+        stream_send(&paths, fileno(fp), window, &netStats);
+        pthread_cancel(netstats_thread);
+        for (int i = 0; i < paths.count; ++i) close(paths.paths[i].sockfd);
+        return;
+    }
+
+    // Send file data, each chunk as big as the path it goes out on wants
+    uint8_t packet[WIRE_MAX_PACKET];
+    pthread_t periodic_sender_thread;
+    netstats_first_data(&netStats);
+    uint64_t offset = 0;
+    uint64_t chunks = 0;
+    uint8_t *buffer = buffer_alloc(max_chunk, paths.low_latency);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+    if (!buffer || !missing) {
+        perror_exit("Failed to allocate buffer");
+    }
+    Path *from;
+    while (offset < file_size) {
+        Path *path = paths_pick(&paths);
+        size_t len = file_size - offset < path->chunk_size ? file_size - offset : path->chunk_size;
+        if (send_file_chunk(&paths, path, fp, offset / CHUNK_UNIT, len, buffer, &netStats) < 0) {
+            perror_exit("Failed to read file");
+        }
+        offset += len;
         if(netStats.sleep_delay > 0) delay_microseconds(netStats.sleep_delay);
+
+        // Keep the path weights and chunk sizes fresh
+        if (++chunks % 64 == 0) {
+            ssize_t n;
+            while ((n = paths_recv(&paths, packet, sizeof(packet), 0, &from)) > 0) {
+                if (wire_get_type(packet, n) == PATH_REPORT) paths_handle_report(&paths, from, packet, n);
+            }
+        }
     }
-    
+    paths_flush(&paths);
 
 
     // Send checks, receive nacks, and retransmit
-    Packet checkPacket;
-    checkPacket.type = CHECK;
+    uint8_t check[WIRE_MAX_PACKET];
+    uint64_t total_units = (file_size + CHUNK_UNIT - 1) / CHUNK_UNIT;
+    size_t check_len = wire_put_check(check, total_units, 0);
     int complete = 0;
 
     while (!complete) {
         // Send periodically the check packet
-        pthread_create(&periodic_sender_thread, NULL, periodic_sender_routine, &(periodic_sender_context_t){
-            .sockfd = sockfd,
-            .addr = (struct sockaddr*)&dest_addr,
-            .addr_len = sizeof(dest_addr),
-            .data = (uint8_t*)&checkPacket,
-            .datalen = sizeof(checkPacket)
+        start_thread(&periodic_sender_thread, periodic_sender_routine, &(periodic_sender_context_t){
+            .paths = &paths,
+            .data = check,
+            .datalen = check_len
         });
         pthread_detach(periodic_sender_thread);
 
         // Listen for nacks
-        NackPacket NackPacket;
         while (1) {
-            ssize_t bytes_received = recvfrom(sockfd, &NackPacket, sizeof(NackPacket), 0, (struct sockaddr*)&dest_addr, &dest_addr_len);
+            ssize_t bytes_received = paths_recv(&paths, packet, sizeof(packet), -1, &from);
             if (bytes_received > 0) {
-                if (NackPacket.type == NACK) {
+                int type = wire_get_type(packet, bytes_received);
+                uint64_t next_seq, echo;
+                int missing_count;
+                if (type == PATH_REPORT) {
+                    paths_handle_report(&paths, from, packet, bytes_received);
+                } else if (type == NACK && (missing_count = wire_get_nack(packet, bytes_received, &next_seq, &echo, missing, WIRE_MAX_RANGES)) >= 0) {
                     pthread_cancel(periodic_sender_thread);
-                    if (NackPacket.count == 0) {
+                    if (missing_count == 0) {
                         complete = 1;
                     }
 
-                    for (uint32_t i = 0; i < NackPacket.count; i++) {
-                        uint32_t seq_num = NackPacket.missing[i];
-                        if (send_file_chunk(sockfd, &dest_addr, dest_addr_len, fp, seq_num, frame_size, buffer, &netStats) < 0) {
-                            fprintf(stderr, "Failed to retransmit packet %u\n", seq_num);
+                    // Missing units go out again in chunks sized for the best path
+                    Path *best = paths_best(&paths);
+                    uint64_t units = best->chunk_size / CHUNK_UNIT;
+                    for (int i = 0; i < missing_count; i++) {
+                        uint64_t end = missing[i].start + missing[i].count;
+                        for (uint64_t seq_num = missing[i].start; seq_num < end && seq_num < total_units; seq_num += units) {
+                            uint64_t count = end - seq_num < units ? end - seq_num : units;
+                            if (send_file_chunk(&paths, best, fp, seq_num, count * CHUNK_UNIT, buffer, &netStats) < 0) {
+                                fprintf(stderr, "Failed to retransmit packet %lu\n", seq_num);
+                            }
                         }
                     }
+                    paths_flush(&paths);
 
                     break;
                 }
@@ -143,7 +209,8 @@ void sender_run(const char *file_path, int argc, char *argv[]) {
     }
 
     pthread_cancel(netstats_thread);
-    free(buffer);
+    buffer_free(buffer, max_chunk, paths.low_latency);
+    free(missing);
     fclose(fp);
-    close(sockfd);
+    for (int i = 0; i < paths.count; ++i) close(paths.paths[i].sockfd);
 }
\ No newline at end of file
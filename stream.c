@@ -0,0 +1,394 @@
+// stream.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "file_transfer.h"
+#include "network.h"
+#include "utils.h"
+#include "packets.h"
+#include "wire.h"
+#include "tune.h"
+
+#define STREAM_HOLDOFF_MARGIN_MS 20 // resends and stall probes wait a round trip plus at least this
+#define STREAM_RTT_PROBE_MS 250     // time one path's round trip this often while data is in flight
+#define STREAM_LINGER_MS 1000           // receiver keeps answering probes this long once done
+
+/*
+
+Streaming keeps a window of `window` bytes in memory on both sides, as a
+ring of units: unit seq lives in ring slot seq % units. The receiver acks
+the first unit it has not delivered yet, the sender never runs further
+than the window ahead of that ack. Chunks never straddle the end of the
+ring. The stream ends with a LAST_CHUNK, which may be short or empty.
+
+A unit is resent only once the ack that lists it missing could have
+seen the last copy, so the holdoff is the slowest path's smoothed round
+trip plus its variation (RFC 6298 style). Round trips are timed from a
+CHECK to the ACK echoing its probe id, on one path at a time in turn;
+ACKs already in flight and answers to lost CHECKs don't count.
+
+*/
+
+typedef struct {
+    uint8_t *ring;
+    uint64_t *sent_at; // per unit, for the retransmit holdoff
+    uint64_t units;    // ring size in units
+    uint64_t base;     // oldest unit not acked yet
+    uint64_t next_seq; // next unit to send
+    int done;          // LAST_CHUNK sent, end_seq and end_bytes are known
+    uint64_t end_seq;
+    uint64_t end_bytes;
+
+    // Round trips per path, in ms
+    double srtt[MAX_PATHS];
+    double rttvar[MAX_PATHS];
+    int timed[MAX_PATHS];    // has a sample
+    int probe_path;          // path of the CHECK being timed, -1 for none
+    uint64_t probe_id;       // its id, ids count up from 1
+    uint64_t probe_t;
+    int next_timed;          // path to time next
+    uint64_t next_rtt_probe;
+} StreamRing;
+
+static void stream_send_chunk(PathSet *paths, Path *path, StreamRing *s, PacketType type, uint64_t seq, size_t len, NetStats *netStats) {
+    uint8_t header[WIRE_CHUNK_HEADER_MAX];
+    size_t header_len = wire_put_chunk_header(header, type, seq);
+
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = s->ring + seq % s->units * CHUNK_UNIT, .iov_len = len }
+    };
+    paths_send(paths, path, iov, 2);
+    netStats->delta_bytes_transfered += header_len + len;
+    netstats_first_data(netStats);
+
+    uint64_t now = get_timestamp_millis();
+    uint64_t count = len ? (len + CHUNK_UNIT - 1) / CHUNK_UNIT : 1;
+    for (uint64_t i = seq; i < seq + count; i++) s->sent_at[i % s->units] = now;
+}
+
+// Units [seq, end) again, in chunks sized for the path
+static void stream_resend(PathSet *paths, Path *path, StreamRing *s, uint64_t seq, uint64_t end, NetStats *netStats) {
+    while (seq < end) {
+        uint64_t count = end - seq;
+        uint64_t slot = seq % s->units;
+        if (count > path->chunk_size / CHUNK_UNIT) count = path->chunk_size / CHUNK_UNIT;
+        if (count > s->units - slot) count = s->units - slot;
+
+        if (s->done && seq + count == s->end_seq) {
+            stream_send_chunk(paths, path, s, LAST_CHUNK, seq, s->end_bytes - seq * CHUNK_UNIT, netStats);
+        } else {
+            stream_send_chunk(paths, path, s, FILE_CHUNK, seq, count * CHUNK_UNIT, netStats);
+        }
+        seq += count;
+    }
+}
+
+// Asks the receiver for an ACK, and times the round trip
+static void stream_send_probe(PathSet *paths, Path *path, StreamRing *s) {
+    uint8_t probe[WIRE_MAX_PACKET];
+    size_t len = wire_put_check(probe, s->next_seq, ++s->probe_id);
+    path_send_packet(paths, path, probe, len);
+    s->probe_path = path - paths->paths;
+    s->probe_t = get_timestamp_millis();
+}
+
+static void stream_rtt_sample(StreamRing *s, int i, double rtt) {
+    if (!s->timed[i]) {
+        s->timed[i] = 1;
+        s->srtt[i] = rtt;
+        s->rttvar[i] = rtt / 2;
+        return;
+    }
+    double err = s->srtt[i] > rtt ? s->srtt[i] - rtt : rtt - s->srtt[i];
+    s->rttvar[i] = 0.75 * s->rttvar[i] + 0.25 * err;
+    s->srtt[i] = 0.875 * s->srtt[i] + 0.125 * rtt;
+}
+
+// How long a sent unit is left alone, and how long a stall goes before a probe
+static uint64_t stream_holdoff(const StreamRing *s, int path_count) {
+    double holdoff = STREAM_HOLDOFF_MARGIN_MS;
+    for (int i = 0; i < path_count; ++i) {
+        double margin = 4 * s->rttvar[i] > STREAM_HOLDOFF_MARGIN_MS ? 4 * s->rttvar[i] : STREAM_HOLDOFF_MARGIN_MS;
+        if (s->srtt[i] + margin > holdoff) holdoff = s->srtt[i] + margin;
+    }
+    return (uint64_t)holdoff;
+}
+
+void stream_send(PathSet *paths, int in_fd, uint32_t window, NetStats *netStats) {
+    StreamRing s = { .units = window / CHUNK_UNIT, .probe_path = -1 };
+    s.ring = buffer_alloc(s.units * CHUNK_UNIT, paths->low_latency);
+    s.sent_at = buffer_alloc(s.units * sizeof(uint64_t), paths->low_latency);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+    if (!s.ring || !s.sent_at || !missing) {
+        perror_exit("Failed to allocate stream window");
+    }
+
+    uint64_t fill = 0;  // bytes read past next_seq, not sent yet
+    Path *next = NULL;  // path for the next new chunk
+    int eof = 0;
+    uint8_t ack[WIRE_MAX_PACKET];
+    Path *from;
+
+    // First round trip, and encrypted it commits the receiver to our keys before any data
+    stream_send_probe(paths, paths_best(paths), &s);
+    s.next_rtt_probe = get_timestamp_millis() + STREAM_RTT_PROBE_MS;
+
+    while (!s.done || s.base != s.next_seq) {
+
+        // Handle every pending ack without blocking
+        ssize_t n;
+        while ((n = paths_recv(paths, ack, sizeof(ack), 0, &from)) > 0) {
+            int type = wire_get_type(ack, n);
+            if (type == PATH_REPORT) {
+                paths_handle_report(paths, from, ack, n);
+                continue;
+            }
+            uint64_t acked, echo;
+            int missing_count;
+            if (type != ACK || (missing_count = wire_get_nack(ack, n, &acked, &echo, missing, WIRE_MAX_RANGES)) < 0) continue;
+
+            if (s.probe_path >= 0 && echo == s.probe_id) {
+                stream_rtt_sample(&s, s.probe_path, get_timestamp_millis() - s.probe_t);
+                s.probe_path = -1;
+            }
+
+            if (acked > s.base && acked <= s.next_seq) {
+                s.base = acked;
+            }
+
+            // Resend runs of missing units that weren't sent too recently
+            uint64_t now = get_timestamp_millis();
+            uint64_t holdoff = stream_holdoff(&s, paths->count);
+            Path *best = paths_best(paths);
+            for (int i = 0; i < missing_count; i++) {
+                uint64_t seq = missing[i].start > s.base ? missing[i].start : s.base;
+                uint64_t end = missing[i].start + missing[i].count;
+                if (end > s.next_seq) end = s.next_seq;
+                while (seq < end) {
+                    while (seq < end && now - s.sent_at[seq % s.units] < holdoff) seq++;
+                    uint64_t run = seq;
+                    while (run < end && now - s.sent_at[run % s.units] >= holdoff) run++;
+                    stream_resend(paths, best, &s, seq, run, netStats);
+                    seq = run;
+                }
+            }
+        }
+
+        // Send every whole chunk that's been read, and the last one once the input ended
+        while (!s.done) {
+            if (!next) next = paths_pick(paths);
+            uint64_t slot = s.next_seq % s.units;
+            uint64_t len = next->chunk_size;
+            if (len > (s.units - slot) * CHUNK_UNIT) len = (s.units - slot) * CHUNK_UNIT;
+
+            if (fill >= len) {
+                stream_send_chunk(paths, next, &s, FILE_CHUNK, s.next_seq, len, netStats);
+                s.next_seq += len / CHUNK_UNIT;
+                fill -= len;
+                next = NULL;
+                if(netStats->sleep_delay > 0) delay_microseconds(netStats->sleep_delay);
+                continue;
+            }
+            if (!eof) break;
+
+            // An empty last chunk still takes a unit, which may have to wait for an ack
+            uint64_t count = fill ? (fill + CHUNK_UNIT - 1) / CHUNK_UNIT : 1;
+            if (s.next_seq + count - s.base > s.units) break;
+            s.done = 1;
+            s.end_seq = s.next_seq + count;
+            s.end_bytes = s.next_seq * CHUNK_UNIT + fill;
+            stream_send_chunk(paths, next, &s, LAST_CHUNK, s.next_seq, fill, netStats);
+            s.next_seq = s.end_seq;
+            fill = 0;
+            next = NULL;
+        }
+
+        if (s.done && s.base == s.next_seq) break;
+
+        // Keep the round trips fresh, one path at a time. Idle, only until a probe got answered.
+        uint64_t now = get_timestamp_millis();
+        if ((s.base != s.next_seq || s.probe_path >= 0) && now >= s.next_rtt_probe) {
+            stream_send_probe(paths, &paths->paths[s.next_timed], &s);
+            s.next_timed = (s.next_timed + 1) % paths->count;
+            s.next_rtt_probe = now + STREAM_RTT_PROBE_MS;
+        }
+
+        uint64_t buffered = (s.next_seq - s.base) * CHUNK_UNIT + fill;
+        int can_read = !eof && buffered < s.units * CHUNK_UNIT;
+        int input_ready;
+        paths_flush(paths);
+        int ready = paths_wait(paths, can_read ? in_fd : -1, stream_holdoff(&s, paths->count), &input_ready);
+        if (ready < 0) {
+            perror_exit("poll failed");
+        }
+        if (ready == 0) {
+            // Window stalled or input idle: ask the receiver where it stands
+            if (s.base != s.next_seq) stream_send_probe(paths, paths_best(paths), &s);
+            continue;
+        }
+        if (!input_ready) continue;
+
+        // Read as much as fits before the window edge or the ring end
+        uint64_t pos = (s.next_seq * CHUNK_UNIT + fill) % (s.units * CHUNK_UNIT);
+        uint64_t room = s.units * CHUNK_UNIT - buffered;
+        if (room > s.units * CHUNK_UNIT - pos) room = s.units * CHUNK_UNIT - pos;
+        n = read(in_fd, s.ring + pos, room);
+        if (n < 0) {
+            perror_exit("Failed to read input");
+        }
+        if (n == 0) eof = 1;
+        fill += n;
+    }
+
+    printf("Stream complete, %lu bytes sent.\n", s.end_bytes);
+    buffer_free(s.ring, s.units * CHUNK_UNIT, paths->low_latency);
+    buffer_free(s.sent_at, s.units * sizeof(uint64_t), paths->low_latency);
+    free(missing);
+}
+
+// Ack everything before base and list the holes up to highest, as far as one packet goes
+static void stream_send_ack(PathSet *paths, Path *path, uint64_t base, uint64_t highest, uint64_t echo, uint8_t *have, uint64_t units, SeqRange *missing) {
+    size_t count = 0;
+    uint64_t seq = base;
+    while (seq < highest && count < WIRE_MAX_RANGES) {
+        if (have[seq % units]) {
+            seq++;
+            continue;
+        }
+        missing[count].start = seq;
+        while (seq < highest && !have[seq % units]) seq++;
+        missing[count].count = seq - missing[count].start;
+        count++;
+    }
+
+    send_nack(paths, path, ACK, base, echo, missing, count);
+}
+
+static void write_all(int fd, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            perror_exit("Failed to write output");
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void stream_receive(PathSet *paths, int out_fd, uint32_t unit_size, uint32_t max_chunk, uint32_t window, NetStats *netStats) {
+    uint64_t units = window / unit_size;
+    uint8_t *ring = buffer_alloc(units * unit_size, paths->low_latency);
+    uint8_t *have = buffer_alloc(units, paths->low_latency);
+    uint8_t *buffer = buffer_alloc(max_chunk + WIRE_CHUNK_HEADER_MAX, paths->low_latency);
+    SeqRange *missing = malloc(WIRE_MAX_RANGES * sizeof(SeqRange));
+    if (units == 0 || !ring || !have || !buffer || !missing) {
+        perror_exit("Failed to allocate stream window");
+    }
+
+    uint64_t base = 0;    // next unit to write out
+    uint64_t highest = 0; // one past the highest unit we know of
+    uint64_t end_seq = UINT64_MAX; // known once the LAST_CHUNK arrives
+    uint64_t end_bytes = 0;
+    uint64_t since_ack = 0;
+    uint64_t ack_every = units / 8 ? units / 8 : 1; // in units
+    int complete = 0;
+    Path *from;
+
+    while (!complete) {
+        ssize_t n = paths_recv(paths, buffer, max_chunk + WIRE_CHUNK_HEADER_MAX, -1, &from);
+        paths_send_reports(paths);
+        int type = wire_get_type(buffer, n > 0 ? n : 0);
+        if (type < 0) {
+            fprintf(stderr, "Received an incomplete packet\n");
+            continue;
+        }
+
+        uint64_t seq, probe;
+        int header_len;
+        if ((type == FILE_CHUNK || type == LAST_CHUNK) && (header_len = wire_get_chunk_header(buffer, n, &seq)) >= 0) {
+            netstats_first_data(netStats);
+
+            // Whole units, except for the last chunk
+            uint32_t data_len = n - header_len;
+            uint64_t count = data_len ? (data_len + unit_size - 1) / unit_size : 1;
+            if (data_len > max_chunk || (type == FILE_CHUNK && (data_len == 0 || data_len % unit_size))) {
+                fprintf(stderr, "Invalid packet size or corrupted data\n");
+                continue;
+            }
+
+            if (seq < base) continue; // already written out
+            if (seq + count - base > units || seq % units + count > units || seq + count > end_seq) {
+                fprintf(stderr, "Received out-of-window packet %lu\n", seq);
+                continue;
+            }
+
+            if (type == LAST_CHUNK) {
+                end_seq = seq + count;
+                end_bytes = seq * unit_size + data_len;
+            }
+
+            memcpy(ring + seq % units * unit_size, buffer + header_len, data_len);
+            for (uint64_t i = seq; i < seq + count; i++) {
+                if (have[i % units]) continue;
+                have[i % units] = 1;
+                netStats->delta_bytes_transfered += unit_size;
+                since_ack++;
+            }
+            if (seq + count > highest) highest = seq + count;
+
+            // Write out the in-order run starting at base, one write per ring pass
+            while (!complete && have[base % units]) {
+                uint64_t first = base % units;
+                uint64_t slot = first;
+                while (slot < units && have[slot] && base < end_seq) {
+                    have[slot++] = 0;
+                    base++;
+                }
+                size_t bytes = (slot - first) * unit_size;
+                if (base == end_seq) {
+                    bytes -= end_seq * unit_size - end_bytes;
+                    complete = 1;
+                }
+                write_all(out_fd, ring + first * unit_size, bytes);
+            }
+
+            if (complete || since_ack >= ack_every) {
+                stream_send_ack(paths, from, base, highest, 0, have, units, missing);
+                since_ack = 0;
+            }
+
+        } else if (type == INIT) {
+            path_ack_init(paths, from, buffer, n); // our ack got lost, or this path wasn't confirmed yet
+
+        } else if (type == CHECK && wire_get_check(buffer, n, &seq, &probe) >= 0) {
+            if (seq > highest && seq - base <= units) {
+                highest = seq;
+            }
+            stream_send_ack(paths, from, base, highest, probe, have, units, missing);
+            since_ack = 0;
+        }
+    }
+
+    // The final ack may get lost: answer probes until the sender goes quiet
+    ssize_t n;
+    uint64_t seq, probe;
+    while ((n = paths_recv(paths, buffer, max_chunk + WIRE_CHUNK_HEADER_MAX, STREAM_LINGER_MS, &from)) >= 0) {
+        if (wire_get_check(buffer, n, &seq, &probe) >= 0) {
+            stream_send_ack(paths, from, base, base, probe, have, units, missing);
+        }
+    }
+
+    printf("Stream complete, %lu bytes received. Startup: %lu ms to first data\n", end_bytes, netStats->startup_ms);
+    if (paths->aead) printf("Rejected %lu packets that failed authentication\n", aead_rejected(paths->aead));
+    buffer_free(ring, units * unit_size, paths->low_latency);
+    buffer_free(have, units, paths->low_latency);
+    buffer_free(buffer, max_chunk + WIRE_CHUNK_HEADER_MAX, paths->low_latency);
+    free(missing);
+}
@@ -0,0 +1,54 @@
+// tune.c
+#include <math.h>
+#include <stdint.h>
+#include "tune.h"
+
+#define IP_FRAGMENT_HEADER 20 // every extra fragment repeats the IP header
+#define TUNE_MAX_LOSS 0.5     // past this the loss says more about the path than the size
+#define TUNE_MIN_GAIN 0.01    // don't move for less than 1% less load
+#define TUNE_MAX_GROWTH 2     // grow at most this much per report, shrinking is immediate
+
+/*
+
+Same model as opti.py: sending a chunk of `size` bytes costs
+(1 + overhead / size) on the wire, and it is lost (and sent again) if
+any of its max(size / mtu, 1) fragments is, which happens with
+probability 1 - (1 - p)^fragments. The load is bytes on the wire per
+byte delivered, lower is better.
+
+*/
+double chunk_load(double size, double fragment_loss, double mtu_payload, double overhead) {
+    double fragments = size / mtu_payload > 1 ? size / mtu_payload : 1;
+    overhead += IP_FRAGMENT_HEADER * (fragments - 1);
+    return (2 - pow(1 - fragment_loss, fragments)) * (1 + overhead / size);
+}
+
+/*
+
+Picks the chunk size with the lowest load given `loss`, the datagram loss
+measured while sending `current` sized chunks. overhead is what each
+datagram costs besides its data, in bytes.
+
+*/
+uint32_t tune_chunk_size(uint32_t current, double loss, uint32_t mtu_payload, double overhead, uint32_t max_chunk) {
+    if (loss > TUNE_MAX_LOSS) loss = TUNE_MAX_LOSS;
+
+    // Datagram loss -> loss of a single MTU sized fragment
+    double fragments = (double)current / mtu_payload > 1 ? (double)current / mtu_payload : 1;
+    double fragment_loss = 1 - pow(1 - loss, 1 / fragments);
+
+    uint32_t best = current;
+    double current_load = chunk_load(current, fragment_loss, mtu_payload, overhead);
+    double best_load = current_load;
+    for (uint32_t size = CHUNK_UNIT; size <= max_chunk; size += CHUNK_UNIT) {
+        double load = chunk_load(size, fragment_loss, mtu_payload, overhead);
+        if (load < best_load) {
+            best = size;
+            best_load = load;
+        }
+    }
+
+    if (best_load > current_load * (1 - TUNE_MIN_GAIN)) return current;
+    if (best > current * TUNE_MAX_GROWTH) best = current * TUNE_MAX_GROWTH / CHUNK_UNIT * CHUNK_UNIT;
+    return best;
+}
@@ -0,0 +1,13 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdint.h>
+
+#define CHUNK_UNIT 128  // bytes per sequence number, chunks are whole units
+#define CHUNK_MAX 65408 // largest chunk: 65507 byte IPv4 UDP payload minus our header, in whole units
+
+double chunk_load(double size, double fragment_loss, double mtu_payload, double overhead);
+
+uint32_t tune_chunk_size(uint32_t current, double loss, uint32_t mtu_payload, double overhead, uint32_t max_chunk);
+
+#endif // TUNE_H
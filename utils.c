@@ -1,4 +1,5 @@
 // utils.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -8,9 +9,14 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include "utils.h"
 #include "packets.h"
 
+
 void perror_exit(const char *message) {
     perror(message);
     exit(EXIT_FAILURE);
@@ -63,4 +69,58 @@ void delay_microseconds(long delay_us) {
         elapsed_us = (current.tv_sec - start.tv_sec) * 1000000L 
                      + (current.tv_nsec - start.tv_nsec) / 1000L;
     }
-}
\ No newline at end of file
+}
+
+static cpu_set_t unpinned_set; // the process's cores, from before the first pin
+static int unpinned_saved;
+
+// Keeps the calling thread on one core
+int pin_thread(int cpu) {
+    if (!unpinned_saved) {
+        unpinned_saved = pthread_getaffinity_np(pthread_self(), sizeof(unpinned_set), &unpinned_set) == 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper threads get the process's cores, not the pinned core of the thread starting them
+int start_thread(pthread_t *thread, void *(*routine)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (unpinned_saved) pthread_attr_setaffinity_np(&attr, sizeof(unpinned_set), &unpinned_set);
+    int err = pthread_create(thread, &attr, routine, arg);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+/*
+
+Zeroed buffers for chunk data. numa_local ones are mapped on their own,
+bound to the NUMA node of the calling thread (pin it first) and faulted
+in right away, so the hot path neither page-faults nor reaches across
+nodes. Release them with buffer_free and the same size.
+
+*/
+void *buffer_alloc(size_t size, int numa_local) {
+    if (!numa_local || size == 0) return calloc(1, size);
+
+    void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) return NULL;
+
+    // Best effort, first touch from the pinned thread gets the same result
+    syscall(SYS_mbind, buffer, size, MPOL_PREFERRED, NULL, 0, 0); // empty node mask: the local node
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+void buffer_free(void *buffer, size_t size, int numa_local) {
+    if (!numa_local || size == 0) free(buffer);
+    else if (buffer) munmap(buffer, size);
+}
@@ -3,6 +3,8 @@
 #define UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 
 uint64_t get_timestamp_millis();
@@ -10,5 +12,9 @@ double format_size_with_unit(uint64_t bytes, char *unit);
 void perror_exit(const char *message);
 void *netstats_routine(void *arg);
 void delay_microseconds(long delay_us);
+int pin_thread(int cpu);
+int start_thread(pthread_t *thread, void *(*routine)(void *), void *arg);
+void *buffer_alloc(size_t size, int numa_local);
+void buffer_free(void *buffer, size_t size, int numa_local);
 
 #endif // UTILS_H
@@ -0,0 +1,304 @@
+// wire.c
+#include <stdint.h>
+#include <string.h>
+#include "wire.h"
+
+/*
+
+Every datagram starts with one byte, the wire version in the top 3 bits
+and the PacketType in the low 5. Integers that follow are LEB128 varints,
+so there's no padding and no byte order to agree on. FILE_CHUNK data runs
+to the end of the datagram.
+
+INIT        file_size unit_size max_chunk window flags   (the receiver acks with a bare INIT)
+PUNCH       (nothing)
+FILE_CHUNK  seq_num data...
+LAST_CHUNK  seq_num data...
+CHECK       next_seq probe
+NACK, ACK   next_seq echo mode ranges...
+PATH_REPORT received_packets received_bytes
+SLOWDOWN    bitrate
+
+NACK/ACK list missing chunks as sorted ranges, in whichever mode is the
+smaller for them:
+  mode 0: (gap since previous range end, count - 1) pairs
+  mode 1: gap to the first missing chunk, then a bitmap of missing chunks
+Gaps start from next_seq.
+
+A CHECK that times a round trip carries a nonzero probe id, and the ACK
+answering it echoes that id. Everything else has 0 there.
+
+With INIT_AEAD everything after the handshake is sealed (crypto.c): the
+type byte, a varint (seq_num for chunks, a counter for the others), the
+rest of the packet encrypted, and a 16 byte tag.
+
+*/
+
+#define TYPE_BITS 5
+#define RANGE_MODE 0
+#define BITMAP_MODE 1
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static size_t varint_size(uint64_t value) {
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// Returns bytes read, 0 if truncated or too long
+static size_t get_varint(const uint8_t *in, size_t len, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t n = 0; n < len && n < 10; n++) {
+        result |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+        if (!(in[n] & 0x80)) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static size_t get_varint32(const uint8_t *in, size_t len, uint32_t *value) {
+    uint64_t wide;
+    size_t n = get_varint(in, len, &wide);
+    if (n == 0 || wide > UINT32_MAX) return 0;
+    *value = (uint32_t)wide;
+    return n;
+}
+
+int wire_get_type(const uint8_t *in, size_t len) {
+    if (len < 1 || in[0] >> TYPE_BITS != WIRE_VERSION) return -1;
+    return in[0] & ((1 << TYPE_BITS) - 1);
+}
+
+size_t wire_put_type(uint8_t *out, PacketType type) {
+    out[0] = (WIRE_VERSION << TYPE_BITS) | type;
+    return 1;
+}
+
+size_t wire_put_init(uint8_t *out, const InitPacket *init) {
+    size_t n = wire_put_type(out, INIT);
+    n += put_varint(out + n, init->file_size);
+    n += put_varint(out + n, init->unit_size);
+    n += put_varint(out + n, init->max_chunk);
+    n += put_varint(out + n, init->window);
+    n += put_varint(out + n, init->flags);
+    return n;
+}
+
+int wire_get_init(const uint8_t *in, size_t len, InitPacket *init) {
+    size_t n = 1, m;
+    if (wire_get_type(in, len) != INIT) return -1;
+    if (!(m = get_varint(in + n, len - n, &init->file_size))) return -1;
+    n += m;
+    if (!(m = get_varint32(in + n, len - n, &init->unit_size))) return -1;
+    n += m;
+    if (!(m = get_varint32(in + n, len - n, &init->max_chunk))) return -1;
+    n += m;
+    if (!(m = get_varint32(in + n, len - n, &init->window))) return -1;
+    n += m;
+    if (!(m = get_varint32(in + n, len - n, &init->flags))) return -1;
+    if (init->unit_size == 0 || init->max_chunk < init->unit_size) return -1;
+    return n + m;
+}
+
+size_t wire_put_chunk_header(uint8_t *out, PacketType type, uint64_t seq_num) {
+    size_t n = wire_put_type(out, type);
+    return n + put_varint(out + n, seq_num);
+}
+
+// FILE_CHUNK or LAST_CHUNK. Returns the header length, the data is the rest of the datagram
+int wire_get_chunk_header(const uint8_t *in, size_t len, uint64_t *seq_num) {
+    int type = wire_get_type(in, len);
+    if (type != FILE_CHUNK && type != LAST_CHUNK) return -1;
+    size_t m = get_varint(in + 1, len - 1, seq_num);
+    return m ? (int)(1 + m) : -1;
+}
+
+size_t wire_put_sealed_header(uint8_t *out, PacketType type, uint64_t value) {
+    size_t n = wire_put_type(out, type);
+    return n + put_varint(out + n, value);
+}
+
+int wire_get_sealed_header(const uint8_t *in, size_t len, uint64_t *value) {
+    if (wire_get_type(in, len) < 0) return -1;
+    size_t m = get_varint(in + 1, len - 1, value);
+    return m ? (int)(1 + m) : -1;
+}
+
+size_t wire_put_check(uint8_t *out, uint64_t next_seq, uint64_t probe) {
+    size_t n = wire_put_type(out, CHECK);
+    n += put_varint(out + n, next_seq);
+    return n + put_varint(out + n, probe);
+}
+
+int wire_get_check(const uint8_t *in, size_t len, uint64_t *next_seq, uint64_t *probe) {
+    if (wire_get_type(in, len) != CHECK) return -1;
+    size_t n = 1, m;
+    if (!(m = get_varint(in + n, len - n, next_seq))) return -1;
+    n += m;
+    if (!(m = get_varint(in + n, len - n, probe))) return -1;
+    return (int)(n + m);
+}
+
+// How many ranges fit in `cap` body bytes in each mode, and how big that is
+static size_t fit_ranges(uint64_t next_seq, const SeqRange *ranges, size_t count, size_t cap, size_t *bytes) {
+    size_t n = 1;
+    uint64_t prev = next_seq;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        size_t m = varint_size(ranges[i].start - prev) + varint_size(ranges[i].count - 1);
+        if (n + m > cap) break;
+        n += m;
+        prev = ranges[i].start + ranges[i].count;
+    }
+    *bytes = n;
+    return i;
+}
+
+static size_t fit_bitmap(uint64_t next_seq, const SeqRange *ranges, size_t count, size_t cap, size_t *bytes) {
+    *bytes = 1;
+    if (count == 0) return 0;
+    size_t head = 1 + varint_size(ranges[0].start - next_seq);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        uint64_t bits = ranges[i].start - ranges[0].start + ranges[i].count;
+        if (head + (bits + 7) / 8 > cap) break;
+        *bytes = head + (bits + 7) / 8;
+    }
+    return i;
+}
+
+/*
+
+Encodes as many of the sorted `ranges` as fit in `cap` bytes into a NACK
+or ACK, sets *used to how many made it and returns the packet length.
+Picks the mode that fits the most ranges, the smaller one on a tie.
+
+*/
+size_t wire_put_nack(uint8_t *out, size_t cap, PacketType type, uint64_t next_seq, uint64_t echo, const SeqRange *ranges, size_t count, size_t *used) {
+    size_t n = wire_put_type(out, type);
+    n += put_varint(out + n, next_seq);
+    n += put_varint(out + n, echo);
+
+    size_t range_bytes, bitmap_bytes;
+    size_t range_fit = fit_ranges(next_seq, ranges, count, cap - n, &range_bytes);
+    size_t bitmap_fit = fit_bitmap(next_seq, ranges, count, cap - n, &bitmap_bytes);
+
+    if (bitmap_fit > range_fit || (bitmap_fit == range_fit && bitmap_bytes < range_bytes)) {
+        out[n++] = BITMAP_MODE;
+        uint64_t first = ranges[0].start;
+        n += put_varint(out + n, first - next_seq);
+        size_t bitmap_len = bitmap_bytes - 1 - varint_size(first - next_seq);
+        memset(out + n, 0, bitmap_len);
+        for (size_t i = 0; i < bitmap_fit; i++) {
+            uint64_t bit = ranges[i].start - first;
+            for (uint32_t j = 0; j < ranges[i].count; j++, bit++) {
+                out[n + bit / 8] |= 1 << (bit % 8);
+            }
+        }
+        *used = bitmap_fit;
+        return n + bitmap_len;
+    }
+
+    out[n++] = RANGE_MODE;
+    uint64_t prev = next_seq;
+    for (size_t i = 0; i < range_fit; i++) {
+        n += put_varint(out + n, ranges[i].start - prev);
+        n += put_varint(out + n, ranges[i].count - 1);
+        prev = ranges[i].start + ranges[i].count;
+    }
+    *used = range_fit;
+    return n;
+}
+
+// Returns the number of ranges decoded into `ranges`, -1 if malformed
+int wire_get_nack(const uint8_t *in, size_t len, uint64_t *next_seq, uint64_t *echo, SeqRange *ranges, size_t max) {
+    int type = wire_get_type(in, len);
+    if (type != NACK && type != ACK) return -1;
+
+    size_t n = 1, m;
+    if (!(m = get_varint(in + n, len - n, next_seq))) return -1;
+    n += m;
+    if (!(m = get_varint(in + n, len - n, echo))) return -1;
+    n += m;
+    if (n >= len) return -1;
+    uint8_t mode = in[n++];
+    size_t count = 0;
+    uint64_t prev = *next_seq;
+
+    if (mode == RANGE_MODE) {
+        while (n < len) {
+            uint64_t gap;
+            uint32_t extra;
+            if (!(m = get_varint(in + n, len - n, &gap))) return -1;
+            n += m;
+            if (!(m = get_varint32(in + n, len - n, &extra))) return -1;
+            n += m;
+            if (count == max) return -1;
+            ranges[count].start = prev + gap;
+            ranges[count].count = extra + 1;
+            prev = ranges[count].start + ranges[count].count;
+            count++;
+        }
+    } else if (mode == BITMAP_MODE) {
+        uint64_t gap;
+        if (!(m = get_varint(in + n, len - n, &gap))) return -1;
+        n += m;
+        uint64_t first = prev + gap;
+        size_t bits = (len - n) * 8;
+        for (size_t bit = 0; bit < bits; bit++) {
+            if (!(in[n + bit / 8] & (1 << (bit % 8)))) continue;
+            if (count > 0 && ranges[count - 1].start + ranges[count - 1].count == first + bit) {
+                ranges[count - 1].count++;
+                continue;
+            }
+            if (count == max) return -1;
+            ranges[count].start = first + bit;
+            ranges[count].count = 1;
+            count++;
+        }
+    } else {
+        return -1;
+    }
+    return count;
+}
+
+size_t wire_put_path_report(uint8_t *out, const PathReportPacket *report) {
+    size_t n = wire_put_type(out, PATH_REPORT);
+    n += put_varint(out + n, report->received_packets);
+    n += put_varint(out + n, report->received_bytes);
+    return n;
+}
+
+int wire_get_path_report(const uint8_t *in, size_t len, PathReportPacket *report) {
+    size_t n = 1, m;
+    if (wire_get_type(in, len) != PATH_REPORT) return -1;
+    if (!(m = get_varint(in + n, len - n, &report->received_packets))) return -1;
+    n += m;
+    if (!(m = get_varint(in + n, len - n, &report->received_bytes))) return -1;
+    return n + m;
+}
+
+size_t wire_put_slowdown(uint8_t *out, uint64_t bitrate) {
+    size_t n = wire_put_type(out, SLOWDOWN);
+    return n + put_varint(out + n, bitrate);
+}
+
+int wire_get_slowdown(const uint8_t *in, size_t len, uint64_t *bitrate) {
+    if (wire_get_type(in, len) != SLOWDOWN) return -1;
+    size_t m = get_varint(in + 1, len - 1, bitrate);
+    return m ? (int)(1 + m) : -1;
+}
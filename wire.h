@@ -0,0 +1,39 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "packets.h"
+
+#define WIRE_CHUNK_HEADER_MAX 11 // type byte + seq varint
+#define WIRE_MAX_PACKET 1400    // control packets never grow past this
+#define WIRE_MAX_RANGES (4 * WIRE_MAX_PACKET) // most ranges a NACK can decode to
+
+// Type of the datagram, -1 if it's empty or from another wire version
+int wire_get_type(const uint8_t *in, size_t len);
+
+size_t wire_put_type(uint8_t *out, PacketType type);
+
+size_t wire_put_init(uint8_t *out, const InitPacket *init);
+int wire_get_init(const uint8_t *in, size_t len, InitPacket *init);
+
+size_t wire_put_chunk_header(uint8_t *out, PacketType type, uint64_t seq_num);
+int wire_get_chunk_header(const uint8_t *in, size_t len, uint64_t *seq_num);
+
+// Sealed datagrams: type byte, then a varint (the seq number, or a counter for control packets)
+size_t wire_put_sealed_header(uint8_t *out, PacketType type, uint64_t value);
+int wire_get_sealed_header(const uint8_t *in, size_t len, uint64_t *value);
+
+size_t wire_put_check(uint8_t *out, uint64_t next_seq, uint64_t probe);
+int wire_get_check(const uint8_t *in, size_t len, uint64_t *next_seq, uint64_t *probe);
+
+size_t wire_put_nack(uint8_t *out, size_t cap, PacketType type, uint64_t next_seq, uint64_t echo, const SeqRange *ranges, size_t count, size_t *used);
+int wire_get_nack(const uint8_t *in, size_t len, uint64_t *next_seq, uint64_t *echo, SeqRange *ranges, size_t max);
+
+size_t wire_put_path_report(uint8_t *out, const PathReportPacket *report);
+int wire_get_path_report(const uint8_t *in, size_t len, PathReportPacket *report);
+
+size_t wire_put_slowdown(uint8_t *out, uint64_t bitrate);
+int wire_get_slowdown(const uint8_t *in, size_t len, uint64_t *bitrate);
+
+#endif // WIRE_H